@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <AL/al.h>
+#include <AL/alc.h>
+
+// A stream of mono float samples. read() blocks until count samples are available
+// and only returns fewer at the end of the stream.
+class AudioSource {
+  public:
+    virtual ~AudioSource() = default;
+
+    virtual size_t sample_rate() const = 0;
+
+    virtual size_t read(float *samples, size_t count) = 0;
+};
+
+// Analysis window over the most recent samples of a stream
+class SampleWindow {
+  public:
+    explicit SampleWindow(size_t size) : data(size, 0.0f) {}
+
+    size_t size() const {
+        return data.size();
+    }
+
+    void push(const float *samples, size_t count) {
+        if (count >= data.size()) {
+            std::copy(samples + count - data.size(), samples + count, data.begin());
+            pos = 0;
+            return;
+        }
+
+        const size_t first = std::min(count, data.size() - pos);
+        std::copy(samples, samples + first, data.begin() + pos);
+        std::copy(samples + first, samples + count, data.begin());
+        pos = (pos + count) % data.size();
+    }
+
+    // Copies the window out oldest sample first
+    void copy_to(float *out) const {
+        const size_t tail = data.size() - pos;
+        std::copy(data.begin() + pos, data.end(), out);
+        std::copy(data.begin(), data.begin() + pos, out + tail);
+    }
+
+  private:
+    std::vector<float> data;
+    // index of the oldest sample
+    size_t pos = 0;
+};
+
+// Interleaved PCM read from a file descriptor, either raw or the data chunk of a WAV file.
+// Channels are mixed down to mono.
+class PcmSource : public AudioSource {
+  public:
+    enum class Encoding {
+        S16,
+        F32,
+    };
+
+    struct Format {
+        Encoding encoding = Encoding::S16;
+        size_t channels = 2;
+        size_t rate = 44100;
+    };
+
+    // Opens a WAV file, or reads raw PCM in raw_format if the input has no RIFF header.
+    // "-" reads from stdin.
+    static std::unique_ptr<PcmSource> open(const std::string &path, const Format &raw_format) {
+        int fd = STDIN_FILENO;
+        if (path != "-") {
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("Failed to open " + path + ": " + std::strerror(errno));
+        }
+
+        std::unique_ptr<PcmSource> source(new PcmSource(fd, path != "-", raw_format));
+        source->read_header(path);
+        return source;
+    }
+
+    ~PcmSource() {
+        if (owns_fd)
+            close(fd);
+    }
+
+    PcmSource(const PcmSource &) = delete;
+    PcmSource &operator=(const PcmSource &) = delete;
+
+    size_t sample_rate() const override {
+        return format.rate;
+    }
+
+    size_t read(float *samples, size_t count) override {
+        const size_t frame_size = format.channels * sample_size();
+        bytes.resize(count * frame_size);
+        const size_t frames = read_bytes(bytes.data(), bytes.size()) / frame_size;
+
+        const float scale = 1.0f / (float)format.channels;
+        for (size_t i = 0; i < frames; i++) {
+            const uint8_t *frame = bytes.data() + i * frame_size;
+            float sum = 0;
+            for (size_t c = 0; c < format.channels; c++) {
+                if (format.encoding == Encoding::S16) {
+                    int16_t value;
+                    std::memcpy(&value, frame + c * sizeof(value), sizeof(value));
+                    sum += value * (1.0f / 32768.0f);
+                } else {
+                    float value;
+                    std::memcpy(&value, frame + c * sizeof(value), sizeof(value));
+                    sum += value;
+                }
+            }
+            samples[i] = sum * scale;
+        }
+        return frames;
+    }
+
+  private:
+    static const uint16_t wav_pcm = 1;
+    static const uint16_t wav_float = 3;
+    static const uint16_t wav_extensible = 0xfffe;
+    // WAVE_FORMAT_EXTENSIBLE needs 40, anything much larger is not a fmt chunk
+    static const size_t max_fmt_size = 64;
+
+    int fd;
+    bool owns_fd;
+    Format format;
+    // header bytes that turned out to be samples of a raw stream
+    std::vector<uint8_t> pending;
+    // bytes left in the WAV data chunk
+    uint64_t remaining = UINT64_MAX;
+    std::vector<uint8_t> bytes;
+
+    PcmSource(int fd, bool owns_fd, const Format &format) : fd(fd), owns_fd(owns_fd), format(format) {}
+
+    size_t sample_size() const {
+        return format.encoding == Encoding::S16 ? sizeof(int16_t) : sizeof(float);
+    }
+
+    static uint16_t le16(const uint8_t *p) {
+        return p[0] | (p[1] << 8);
+    }
+
+    static uint32_t le32(const uint8_t *p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    // Reads until size bytes are read or the input ends
+    size_t read_bytes(uint8_t *out, size_t size) {
+        size = (size_t)std::min<uint64_t>(size, remaining);
+
+        size_t done = std::min(size, pending.size());
+        std::copy(pending.begin(), pending.begin() + done, out);
+        pending.erase(pending.begin(), pending.begin() + done);
+
+        while (done < size) {
+            const ssize_t n = ::read(fd, out + done, size - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                throw std::runtime_error(std::string("Failed to read audio input: ") + std::strerror(errno));
+            if (n == 0)
+                break;
+            done += n;
+        }
+
+        if (remaining != UINT64_MAX)
+            remaining -= done;
+        return done;
+    }
+
+    // Discards size bytes of input, throws if it ends first
+    void skip_bytes(uint64_t size, const std::string &path) {
+        uint8_t scratch[4096];
+        while (size > 0) {
+            const size_t n = read_bytes(scratch, (size_t)std::min<uint64_t>(size, sizeof(scratch)));
+            if (n == 0)
+                throw std::runtime_error(path + ": truncated WAV file");
+            size -= n;
+        }
+    }
+
+    void read_header(const std::string &path) {
+        uint8_t riff[12];
+        const size_t n = read_bytes(riff, sizeof(riff));
+        if (n < sizeof(riff) || std::memcmp(riff, "RIFF", 4) != 0 || std::memcmp(riff + 8, "WAVE", 4) != 0) {
+            pending.assign(riff, riff + n);
+            return;
+        }
+
+        bool have_format = false;
+        while (true) {
+            uint8_t chunk[8];
+            if (read_bytes(chunk, sizeof(chunk)) < sizeof(chunk))
+                throw std::runtime_error(path + ": WAV file has no data chunk");
+            const uint32_t chunk_size = le32(chunk + 4);
+
+            if (std::memcmp(chunk, "data", 4) == 0) {
+                if (!have_format)
+                    throw std::runtime_error(path + ": WAV data chunk before fmt chunk");
+                // streamed WAVs often leave the size unset
+                if (chunk_size != 0 && chunk_size != UINT32_MAX)
+                    remaining = chunk_size;
+                return;
+            }
+
+            // chunks are padded to an even size
+            const uint64_t padded_size = (uint64_t)chunk_size + (chunk_size & 1);
+            if (std::memcmp(chunk, "fmt ", 4) != 0) {
+                skip_bytes(padded_size, path);
+                continue;
+            }
+            if (chunk_size < 16 || padded_size > max_fmt_size)
+                throw std::runtime_error(path + ": invalid WAV fmt chunk");
+            uint8_t body[max_fmt_size];
+            if (read_bytes(body, padded_size) < padded_size)
+                throw std::runtime_error(path + ": truncated WAV file");
+
+            uint16_t tag = le16(&body[0]);
+            if (tag == wav_extensible && chunk_size >= 26)
+                tag = le16(&body[24]);
+            const uint16_t bits = le16(&body[14]);
+            format.channels = le16(&body[2]);
+            format.rate = le32(&body[4]);
+            if (tag == wav_pcm && bits == 16) {
+                format.encoding = Encoding::S16;
+            } else if (tag == wav_float && bits == 32) {
+                format.encoding = Encoding::F32;
+            } else {
+                throw std::runtime_error(path + ": only 16 bit integer and 32 bit float WAV files are supported");
+            }
+            if (format.channels == 0 || format.rate == 0)
+                throw std::runtime_error(path + ": invalid WAV fmt chunk");
+            have_format = true;
+        }
+    }
+};
+
+// Mono capture from an OpenAL capture device
+class OpenALSource : public AudioSource {
+  public:
+    using DeviceSelector = std::function<size_t(const std::vector<std::string> &)>;
+
+    OpenALSource(size_t rate, const DeviceSelector &select_device) : rate(rate) {
+        std::vector<std::string> names;
+        const ALCchar *list = alcGetString(nullptr, ALC_CAPTURE_DEVICE_SPECIFIER);
+        for (const ALCchar *name = list; name && *name; name += std::strlen(name) + 1)
+            names.emplace_back(name);
+        if (names.empty())
+            throw std::runtime_error("No audio capture devices found");
+
+        const size_t index = std::min(select_device(names), names.size() - 1);
+        device = alcCaptureOpenDevice(names[index].c_str(), rate, AL_FORMAT_MONO16, capture_size());
+        if (!device)
+            throw std::runtime_error("Failed to open audio capture device " + names[index]);
+        alcCaptureStart(device);
+    }
+
+    ~OpenALSource() {
+        alcCaptureStop(device);
+        alcCaptureCloseDevice(device);
+    }
+
+    OpenALSource(const OpenALSource &) = delete;
+    OpenALSource &operator=(const OpenALSource &) = delete;
+
+    size_t sample_rate() const override {
+        return rate;
+    }
+
+    // Half a second of buffering on the device side, the most one read can ask for
+    size_t capture_size() const {
+        return rate / 2;
+    }
+
+    // Sleeps until the device has captured count samples
+    size_t read(float *samples, size_t count) override {
+        if (count > capture_size())
+            throw std::runtime_error("Audio read of " + std::to_string(count) + " samples exceeds the capture buffer");
+        while (true) {
+            ALCint available = 0;
+            alcGetIntegerv(device, ALC_CAPTURE_SAMPLES, 1, &available);
+            if ((size_t)available >= count)
+                break;
+            const auto missing = std::chrono::microseconds((count - available) * 1000000 / rate);
+            std::this_thread::sleep_for(std::max(missing, std::chrono::microseconds(500)));
+        }
+
+        buffer.resize(count);
+        alcCaptureSamples(device, buffer.data(), count);
+        for (size_t i = 0; i < count; i++)
+            samples[i] = buffer[i] * (1.0f / 32768.0f);
+        return count;
+    }
+
+  private:
+    size_t rate;
+    ALCdevice *device;
+    std::vector<int16_t> buffer;
+};
@@ -0,0 +1,365 @@
+// Microbenchmarks for the per-frame rendering paths.
+// Prints one JSON object per line so runs can be diffed and compared by scripts.
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <memory>
+
+#include "../mk_pro_m.h"
+#include "../sim_transport.h"
+#include "../spectrum_bars.h"
+#include "../compositor.h"
+
+using clock_type = std::chrono::steady_clock;
+
+const size_t num_frames = 256;
+const size_t repeats = 7;
+
+template<typename T>
+static inline void do_not_optimize(T &value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+// Runs f iterations times per sample and reports the median and fastest sample
+template<typename F>
+static void bench(const char *name, size_t iterations, F f) {
+    for (size_t i = 0; i < iterations / 10 + 1; i++)
+        f(i);
+
+    std::vector<double> samples;
+    for (size_t r = 0; r < repeats; r++) {
+        const auto start = clock_type::now();
+        for (size_t i = 0; i < iterations; i++)
+            f(i);
+        const std::chrono::duration<double, std::nano> elapsed = clock_type::now() - start;
+        samples.push_back(elapsed.count() / (double)iterations);
+    }
+    std::sort(samples.begin(), samples.end());
+
+    std::printf(
+        "{\"name\": \"%s\", \"iterations\": %zu, \"repeats\": %zu, \"ns_median\": %.1f, \"ns_min\": %.1f}\n",
+        name, iterations, repeats, samples[samples.size() / 2], samples.front()
+    );
+    std::fflush(stdout);
+}
+
+// The AoS resampling loop set_leds_smooth used before resample_table, kept as the reference
+STRICT_FLOAT static void resample_reference(const CMMKProM::led_matrix matrix, RGB *linear_data, bool use_rgb) {
+    STRICT_FLOAT_BODY
+    for (size_t i = 0; i < CMMKProM::key_scales.size; i++) {
+        const auto& key_scale = CMMKProM::key_scales.arr[i];
+        const auto key = CMMKProM::key_ids.arr[i];
+
+        float r = 0, g = 0, b = 0;
+        for (size_t j = 0; j < key_scale.num_cells; j++) {
+            const auto& cell = key_scale.cell_scales[j];
+            const auto& rgb = matrix[cell.y][cell.x];
+            r += (float)rgb.r * cell.scale;
+            if (use_rgb) {
+                g += (float)rgb.g * cell.scale;
+                b += (float)rgb.b * cell.scale;
+            }
+        }
+        r = std::clamp(r, 0.0f, 255.0f);
+        if (use_rgb) {
+            g = std::clamp(g, 0.0f, 255.0f);
+            b = std::clamp(b, 0.0f, 255.0f);
+        }
+        linear_data[key] = {(uint8_t)r, (uint8_t)g, (uint8_t)b};
+    }
+}
+
+// Synthetic spectrum frames: a few moving peaks over a noise floor, roughly what music produces
+struct Frames {
+    float bars[num_frames][num_bars];
+    uint8_t out_bars[num_frames][num_bars];
+    CMMKProM::led_matrix mono[num_frames]{};
+    CMMKProM::led_matrix rgb[num_frames]{};
+
+    Frames() {
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> noise(0.0f, 0.05f);
+        std::uniform_int_distribution<int> byte(0, 255);
+        BarNormaliser normaliser;
+
+        for (size_t f = 0; f < num_frames; f++) {
+            for (size_t i = 0; i < num_bars; i++) {
+                const float t = (float)f / 40.0f;
+                const float bass = std::exp(-(float)i / 4.0f) * (0.6f + 0.4f * std::sin(t * 7.0f));
+                const float mid = 0.3f * std::exp(-std::pow(((float)i - 12.0f - 5.0f * std::sin(t)) / 3.0f, 2.0f));
+                bars[f][i] = bass + mid + noise(rng);
+            }
+            normaliser.normalise(bars[f], out_bars[f]);
+            bars_to_matrix(out_bars[f], mono[f]);
+
+            for (auto &row : rgb[f])
+                for (auto &cell : row)
+                    cell = {(uint8_t)byte(rng), (uint8_t)byte(rng), (uint8_t)byte(rng)};
+        }
+    }
+};
+
+static bool check_resample_bit_exact(const Frames &frames) {
+    for (size_t f = 0; f < num_frames; f++) {
+        for (bool use_rgb : {false, true}) {
+            const auto &matrix = use_rgb ? frames.rgb[f] : frames.mono[f];
+            RGB expected[256]{};
+            RGB actual[CMMKProM::num_leds];
+            resample_reference(matrix, expected, use_rgb);
+            CMMKProM::resample(matrix, actual, use_rgb);
+            if (std::memcmp(expected, actual, sizeof(actual)) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Largest difference between rendering bars directly and resampling the matrix they fill
+static int bar_table_max_error(const Frames &frames) {
+    int max_error = 0;
+    for (size_t f = 0; f < num_frames; f++) {
+        RGB expected[CMMKProM::num_leds];
+        RGB actual[CMMKProM::num_leds];
+        CMMKProM::resample(frames.mono[f], expected, false);
+        CMMKProM::render_bars(frames.out_bars[f], bar_key_table, actual);
+        for (size_t i = 0; i < CMMKProM::num_leds; i++)
+            max_error = std::max(max_error, std::abs((int)expected[i].r - (int)actual[i].r));
+    }
+    return max_error;
+}
+
+// Largest difference between the integer and float paths, per channel byte
+static int resample_fixed_max_error(const Frames &frames, bool use_rgb) {
+    int max_error = 0;
+    for (size_t f = 0; f < num_frames; f++) {
+        const auto &matrix = use_rgb ? frames.rgb[f] : frames.mono[f];
+        RGB expected[CMMKProM::num_leds];
+        RGB actual[CMMKProM::num_leds];
+        CMMKProM::resample(matrix, expected, use_rgb);
+        CMMKProM::resample_fixed(matrix, actual, use_rgb);
+        const uint8_t *e = &expected[0].r;
+        const uint8_t *a = &actual[0].r;
+        for (size_t i = 0; i < sizeof(expected); i++)
+            max_error = std::max(max_error, std::abs((int)e[i] - (int)a[i]));
+    }
+    return max_error;
+}
+
+static int fixed_bar_table_max_error(const Frames &frames) {
+    int max_error = 0;
+    for (size_t f = 0; f < num_frames; f++) {
+        RGB expected[CMMKProM::num_leds];
+        RGB actual[CMMKProM::num_leds];
+        CMMKProM::render_bars(frames.out_bars[f], bar_key_table, expected);
+        CMMKProM::render_bars(frames.out_bars[f], fixed_bar_key_table, actual);
+        for (size_t i = 0; i < CMMKProM::num_leds; i++)
+            max_error = std::max(max_error, std::abs((int)expected[i].r - (int)actual[i].r));
+    }
+    return max_error;
+}
+
+// Both normalisers run over the same frames, so this includes any drift of the running maximum
+static int normalise_fixed_max_error(const Frames &frames) {
+    BarNormaliser normaliser, fixed;
+    int max_error = 0;
+    for (size_t f = 0; f < num_frames; f++) {
+        uint8_t expected[num_bars];
+        uint8_t actual[num_bars];
+        normaliser.normalise(frames.bars[f], expected);
+        fixed.normalise_fixed(frames.bars[f], actual);
+        for (size_t i = 0; i < num_bars; i++)
+            max_error = std::max(max_error, std::abs((int)expected[i] - (int)actual[i]));
+    }
+    return max_error;
+}
+
+// True if every key comes out at 255 from the integer path when all its input is at 255
+static bool fixed_full_scale() {
+    CMMKProM::led_matrix matrix;
+    std::memset(matrix, 255, sizeof(matrix));
+    uint8_t bars[num_bars];
+    std::memset(bars, 255, sizeof(bars));
+    RGB resampled[CMMKProM::num_leds];
+    RGB rendered[CMMKProM::num_leds];
+    CMMKProM::resample_fixed(matrix, resampled, true);
+    CMMKProM::render_bars(bars, fixed_bar_key_table, rendered);
+    for (size_t i = 0; i < CMMKProM::num_keys; i++) {
+        const RGB &led = resampled[CMMKProM::key_ids.arr[i]];
+        if (led.r != 255 || led.g != 255 || led.b != 255 || rendered[CMMKProM::key_ids.arr[i]].r != 255)
+            return false;
+    }
+    return true;
+}
+
+// With --check only the accuracy checks run. Either way a failed check exits with 1:
+// the float kernels must match resample_reference exactly, the table and integer paths
+// must stay within one step of them and keep full scale.
+int main(int argc, char **argv) {
+    static Frames frames;
+    const bool check_only = argc > 1 && std::string(argv[1]) == "--check";
+
+    const bool bit_exact = check_resample_bit_exact(frames);
+    std::printf(
+        "{\"name\": \"resample_bit_exact\", \"frames\": %zu, \"ok\": %s}\n",
+        num_frames, bit_exact ? "true" : "false"
+    );
+    const int bar_error = bar_table_max_error(frames);
+    std::printf(
+        "{\"name\": \"bar_table_max_error\", \"frames\": %zu, \"entries\": %zu, \"max_error\": %d}\n",
+        num_frames, bar_key_table.num_entries, bar_error
+    );
+
+    const int fixed_errors[] = {
+        normalise_fixed_max_error(frames), resample_fixed_max_error(frames, false),
+        resample_fixed_max_error(frames, true), fixed_bar_table_max_error(frames)
+    };
+    std::printf(
+        "{\"name\": \"fixed_max_error\", \"frames\": %zu, \"normalise\": %d, \"resample\": %d, \"resample_rgb\": %d, \"render_bars\": %d}\n",
+        num_frames, fixed_errors[0], fixed_errors[1], fixed_errors[2], fixed_errors[3]
+    );
+    const bool full_scale = fixed_full_scale();
+    std::printf("{\"name\": \"fixed_full_scale\", \"ok\": %s}\n", full_scale ? "true" : "false");
+
+    const bool ok = bit_exact && bar_error <= 1 && *std::max_element(std::begin(fixed_errors), std::end(fixed_errors)) <= 1
+        && full_scale;
+    if (check_only)
+        return ok ? 0 : 1;
+
+    bench("normalise_bars", 100000, [](size_t i) {
+        static BarNormaliser normaliser;
+        uint8_t out[num_bars];
+        normaliser.normalise(frames.bars[i % num_frames], out);
+        do_not_optimize(out);
+    });
+
+    bench("normalise_bars_fixed", 100000, [](size_t i) {
+        static BarNormaliser normaliser;
+        uint8_t out[num_bars];
+        normaliser.normalise_fixed(frames.bars[i % num_frames], out);
+        do_not_optimize(out);
+    });
+
+    bench("bars_to_matrix", 100000, [](size_t i) {
+        CMMKProM::led_matrix matrix{};
+        bars_to_matrix(frames.out_bars[i % num_frames], matrix);
+        do_not_optimize(matrix);
+    });
+
+    bench("resample_reference", 100000, [](size_t i) {
+        RGB linear[256]{};
+        resample_reference(frames.mono[i % num_frames], linear, false);
+        do_not_optimize(linear);
+    });
+
+    bench("resample_reference_rgb", 100000, [](size_t i) {
+        RGB linear[256]{};
+        resample_reference(frames.rgb[i % num_frames], linear, true);
+        do_not_optimize(linear);
+    });
+
+    bench("resample", 100000, [](size_t i) {
+        RGB linear[CMMKProM::num_leds];
+        CMMKProM::resample(frames.mono[i % num_frames], linear, false);
+        do_not_optimize(linear);
+    });
+
+    bench("resample_rgb", 100000, [](size_t i) {
+        RGB linear[CMMKProM::num_leds];
+        CMMKProM::resample(frames.rgb[i % num_frames], linear, true);
+        do_not_optimize(linear);
+    });
+
+    bench("render_bars", 100000, [](size_t i) {
+        RGB linear[CMMKProM::num_leds];
+        CMMKProM::render_bars(frames.out_bars[i % num_frames], bar_key_table, linear);
+        do_not_optimize(linear);
+    });
+
+    bench("resample_fixed", 100000, [](size_t i) {
+        RGB linear[CMMKProM::num_leds];
+        CMMKProM::resample_fixed(frames.mono[i % num_frames], linear, false);
+        do_not_optimize(linear);
+    });
+
+    bench("resample_fixed_rgb", 100000, [](size_t i) {
+        RGB linear[CMMKProM::num_leds];
+        CMMKProM::resample_fixed(frames.rgb[i % num_frames], linear, true);
+        do_not_optimize(linear);
+    });
+
+    bench("render_bars_fixed", 100000, [](size_t i) {
+        RGB linear[CMMKProM::num_leds];
+        CMMKProM::render_bars(frames.out_bars[i % num_frames], fixed_bar_key_table, linear);
+        do_not_optimize(linear);
+    });
+
+    // Cost per frame as layers are stacked, Normal layers under an opaque one are skipped
+    for (size_t num_layers : {1, 4, 8}) {
+        Compositor compositor;
+        auto highlights = std::make_unique<HighlightEffect>();
+        for (size_t x = 0; x < CMMKProM::key_map_cols; x += 3)
+            highlights->set(x, 2, {1, 1, 1});
+        compositor.add_layer(std::make_unique<SpectrumEffect>(), BlendMode::Add);
+        const BlendMode modes[] = {BlendMode::Screen, BlendMode::Multiply, BlendMode::Lighten, BlendMode::Add};
+        for (size_t i = 1; i < num_layers; i++) {
+            if (i == 1)
+                compositor.add_layer(std::move(highlights), BlendMode::Normal, 0.8f);
+            else
+                compositor.add_layer(std::make_unique<WaveEffect>(Color{0, 0.5f, 1}), modes[i % 4], 0.5f);
+        }
+
+        const std::string name = "compositor_" + std::to_string(num_layers) + "_layers";
+        bench(name.c_str(), 50000, [&compositor](size_t i) {
+            CMMKProM::led_matrix matrix;
+            compositor.render({i / 100.0, frames.out_bars[i % num_frames]}, matrix);
+            do_not_optimize(matrix);
+        });
+    }
+
+    // Upload paths against a zero latency simulated board, so only host side cost is measured
+    {
+        CMMKProM kb(std::make_unique<SimTransport>());
+        bench("set_leds", 20000, [&kb](size_t i) {
+            kb.set_leds(frames.rgb[i % num_frames]);
+        });
+        bench("set_leds_smooth", 20000, [&kb](size_t i) {
+            kb.set_leds_smooth(frames.mono[i % num_frames]);
+        });
+        bench("set_leds_smooth_unchanged", 20000, [&kb](size_t) {
+            kb.set_leds_smooth(frames.mono[0]);
+        });
+        bench("set_leds_from_bars", 20000, [&kb](size_t i) {
+            kb.set_leds_from_bars(frames.out_bars[i % num_frames], bar_key_table);
+        });
+    }
+
+    // Whole spectrum frame: normalisation, matrix fill, resampling and upload
+    for (bool async : {false, true}) {
+        CMMKProM kb(std::make_unique<SimTransport>());
+        if (async)
+            kb.start_async();
+        BarNormaliser normaliser;
+        bench(async ? "end_to_end_async" : "end_to_end", 20000, [&](size_t i) {
+            uint8_t out[num_bars];
+            CMMKProM::led_matrix matrix{};
+            normaliser.normalise(frames.bars[i % num_frames], out);
+            bars_to_matrix(out, matrix);
+            kb.set_leds_smooth(matrix);
+            kb.wait_frame();
+        });
+        bench(async ? "end_to_end_bars_async" : "end_to_end_bars", 20000, [&](size_t i) {
+            uint8_t out[num_bars];
+            normaliser.normalise(frames.bars[i % num_frames], out);
+            kb.set_leds_from_bars(out, bar_key_table);
+            kb.wait_frame();
+        });
+    }
+
+    return ok ? 0 : 1;
+}
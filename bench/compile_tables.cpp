@@ -0,0 +1,7 @@
+// Compiled with -fsyntax-only -ftime-report by `make bench` to measure how long
+// the constexpr key map tables in CMMKProM take to evaluate.
+
+#include "../mk_pro_m.h"
+
+static_assert(CMMKProM::resample_table.num_entries == CMMKProM::num_resample_entries);
+static_assert(CMMKProM::fixed_resample_table.num_entries == CMMKProM::num_resample_entries);
@@ -0,0 +1,10 @@
+# Turns gcc -ftime-report output into JSON lines for the bench results
+BEGIN { FS = ":" }
+/constant expression evaluation/ {
+    split($2, t, " ")
+    printf "{\"name\": \"compile_constexpr_eval\", \"usr_s\": %s, \"wall_s\": %s}\n", t[1], t[7]
+}
+/^ *TOTAL/ {
+    split($2, t, " ")
+    printf "{\"name\": \"compile_total\", \"usr_s\": %s, \"wall_s\": %s}\n", t[1], t[3]
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+#include "mk_pro_m.h"
+#include "spectrum_bars.h"
+
+// Layered lighting effects, composited in float on the key map matrix.
+// Frames are planar and padded to a multiple of 8 cells so the per-cell loops
+// vectorise; everything a frame needs is allocated when the layers are set up.
+
+struct Color {
+    float r = 0;
+    float g = 0;
+    float b = 0;
+};
+
+struct FloatFrame {
+    static const size_t num_cells = CMMKProM::key_map_rows * CMMKProM::key_map_cols;
+    static const size_t padded_cells = (num_cells + 7) / 8 * 8;
+
+    // channels and coverage in [0, 1], cell y * key_map_cols + x
+    alignas(32) float r[padded_cells]{};
+    alignas(32) float g[padded_cells]{};
+    alignas(32) float b[padded_cells]{};
+    alignas(32) float a[padded_cells]{};
+
+    void fill(const Color &color, float alpha) {
+        std::fill(r, r + padded_cells, color.r);
+        std::fill(g, g + padded_cells, color.g);
+        std::fill(b, b + padded_cells, color.b);
+        std::fill(a, a + padded_cells, alpha);
+    }
+};
+
+struct EffectContext {
+    // seconds since the compositor started
+    double time = 0;
+    // num_bars normalised spectrum bars, null when there is no audio
+    const uint8_t *bars = nullptr;
+};
+
+class Effect {
+  public:
+    virtual ~Effect() = default;
+
+    virtual void render(const EffectContext &ctx, FloatFrame &out) = 0;
+
+    // True if render always covers every cell completely, layers below it are then skipped
+    virtual bool opaque() const {
+        return false;
+    }
+};
+
+class SolidEffect : public Effect {
+  public:
+    explicit SolidEffect(const Color &color) : color(color) {}
+
+    void render(const EffectContext &, FloatFrame &out) override {
+        out.fill(color, 1.0f);
+    }
+
+    bool opaque() const override {
+        return true;
+    }
+
+    Color color;
+};
+
+// Spectrum bars spread over the matrix by matrix_to_bar, transparent without audio
+class SpectrumEffect : public Effect {
+  public:
+    explicit SpectrumEffect(const Color &color = {1, 0, 0}) : color(color) {}
+
+    void render(const EffectContext &ctx, FloatFrame &out) override {
+        if (!ctx.bars) {
+            out.fill({}, 0.0f);
+            return;
+        }
+        const uint8_t *cell_bars = &matrix_bars[0][0];
+        for (size_t i = 0; i < FloatFrame::num_cells; i++) {
+            const float v = ctx.bars[cell_bars[i]] * (1.0f / 255.0f);
+            out.r[i] = v * color.r;
+            out.g[i] = v * color.g;
+            out.b[i] = v * color.b;
+            out.a[i] = 1.0f;
+        }
+    }
+
+    Color color;
+
+  private:
+    static constexpr auto matrix_bars = []() constexpr {
+        std::array<std::array<uint8_t, CMMKProM::key_map_cols>, CMMKProM::key_map_rows> bars{};
+        for (size_t y = 0; y < CMMKProM::key_map_rows; y++)
+            for (size_t x = 0; x < CMMKProM::key_map_cols; x++)
+                bars[y][x] = matrix_to_bar[y][x];
+        return bars;
+    }();
+};
+
+// A bright column sweeping across the board, what do_thing() shows
+class WaveEffect : public Effect {
+  public:
+    explicit WaveEffect(const Color &color = {1, 0, 0}, double columns_per_second = 2.0)
+        : color(color), columns_per_second(columns_per_second) {}
+
+    void render(const EffectContext &ctx, FloatFrame &out) override {
+        const double cols = (double)CMMKProM::key_map_cols;
+        const double pos = std::fmod(ctx.time * columns_per_second, cols);
+        float column[CMMKProM::key_map_cols];
+        for (size_t x = 0; x < CMMKProM::key_map_cols; x++) {
+            double dist = std::fabs((double)x - pos);
+            dist = std::min(dist, cols - dist);
+            column[x] = (float)std::clamp(map(dist, 0.0, 1.3, 1.0, 0.0), 20.0 / 255.0, 1.0);
+        }
+        for (size_t i = 0; i < FloatFrame::num_cells; i++) {
+            const float v = column[i % CMMKProM::key_map_cols];
+            out.r[i] = v * color.r;
+            out.g[i] = v * color.g;
+            out.b[i] = v * color.b;
+            out.a[i] = 1.0f;
+        }
+    }
+
+    bool opaque() const override {
+        return true;
+    }
+
+    Color color;
+    double columns_per_second;
+};
+
+// Fixed colours on chosen cells, everything else transparent
+class HighlightEffect : public Effect {
+  public:
+    void set(size_t x, size_t y, const Color &color) {
+        const size_t i = y * CMMKProM::key_map_cols + x;
+        highlights.r[i] = color.r;
+        highlights.g[i] = color.g;
+        highlights.b[i] = color.b;
+        highlights.a[i] = 1.0f;
+    }
+
+    void clear(size_t x, size_t y) {
+        highlights.a[y * CMMKProM::key_map_cols + x] = 0.0f;
+    }
+
+    void clear() {
+        highlights.fill({}, 0.0f);
+    }
+
+    void render(const EffectContext &, FloatFrame &out) override {
+        out = highlights;
+    }
+
+  private:
+    FloatFrame highlights;
+};
+
+enum class BlendMode {
+    Normal,
+    Add,
+    Multiply,
+    Screen,
+    Lighten,
+};
+
+class Compositor {
+  public:
+    static const size_t max_layers = 16;
+
+    // Layers are drawn in the order they were added, the first one at the bottom
+    size_t add_layer(std::unique_ptr<Effect> effect, BlendMode mode = BlendMode::Normal, float opacity = 1.0f) {
+        if (num_layers == max_layers)
+            throw std::runtime_error("Too many compositor layers");
+        Layer &layer = layers[num_layers];
+        layer.effect = std::move(effect);
+        layer.mode = mode;
+        layer.fade_from = layer.fade_to = opacity;
+        layer.fade_duration = 0;
+        return num_layers++;
+    }
+
+    size_t size() const {
+        return num_layers;
+    }
+
+    Effect &effect(size_t layer) {
+        return *layers[layer].effect;
+    }
+
+    void set_blend_mode(size_t layer, BlendMode mode) {
+        layers[layer].mode = mode;
+    }
+
+    void set_opacity(size_t layer, float opacity) {
+        fade(layer, opacity, 0);
+    }
+
+    // Ramps the layer's opacity linearly to target over the given time, starting at the last rendered frame
+    void fade(size_t layer, float target, double seconds) {
+        Layer &l = layers[layer];
+        l.fade_from = l.opacity(time);
+        l.fade_to = target;
+        l.fade_start = time;
+        l.fade_duration = seconds;
+    }
+
+    // Composites every layer into frame()
+    const FloatFrame &render(const EffectContext &ctx) {
+        time = ctx.time;
+
+        // nothing below the topmost fully opaque layer can show through
+        size_t first = 0;
+        for (size_t i = num_layers; i-- > 0;) {
+            const Layer &l = layers[i];
+            if (l.mode == BlendMode::Normal && l.opacity(time) >= 1.0f && l.effect->opaque()) {
+                first = i;
+                break;
+            }
+        }
+
+        out.fill({}, 1.0f);
+        for (size_t i = first; i < num_layers; i++) {
+            Layer &l = layers[i];
+            const float opacity = std::clamp(l.opacity(time), 0.0f, 1.0f);
+            if (opacity <= 0.0f)
+                continue;
+
+            l.effect->render(ctx, scratch);
+            switch (l.mode) {
+                case BlendMode::Normal:
+                    blend(scratch, opacity, [](float, float s) { return s; });
+                    break;
+                case BlendMode::Add:
+                    blend(scratch, opacity, [](float d, float s) { return std::min(d + s, 1.0f); });
+                    break;
+                case BlendMode::Multiply:
+                    blend(scratch, opacity, [](float d, float s) { return d * s; });
+                    break;
+                case BlendMode::Screen:
+                    blend(scratch, opacity, [](float d, float s) { return 1.0f - (1.0f - d) * (1.0f - s); });
+                    break;
+                case BlendMode::Lighten:
+                    blend(scratch, opacity, [](float d, float s) { return std::max(d, s); });
+                    break;
+            }
+        }
+        return out;
+    }
+
+    // Renders and converts to 8 bit, ready for set_leds_smooth with use_rgb on
+    void render(const EffectContext &ctx, CMMKProM::led_matrix matrix) {
+        render(ctx);
+        RGB *cells = &matrix[0][0];
+        for (size_t i = 0; i < FloatFrame::num_cells; i++) {
+            cells[i].r = to_byte(out.r[i]);
+            cells[i].g = to_byte(out.g[i]);
+            cells[i].b = to_byte(out.b[i]);
+        }
+    }
+
+    void render(const EffectContext &ctx, CMMKProM &kb) {
+        render(ctx, matrix);
+        kb.set_leds_smooth(matrix, true);
+    }
+
+    const FloatFrame &frame() const {
+        return out;
+    }
+
+  private:
+    struct Layer {
+        std::unique_ptr<Effect> effect;
+        BlendMode mode = BlendMode::Normal;
+        float fade_from = 1.0f;
+        float fade_to = 1.0f;
+        double fade_start = 0;
+        double fade_duration = 0;
+
+        float opacity(double now) const {
+            if (fade_duration <= 0 || now >= fade_start + fade_duration)
+                return fade_to;
+            const float t = (float)((now - fade_start) / fade_duration);
+            return fade_from + (fade_to - fade_from) * std::max(t, 0.0f);
+        }
+    };
+
+    std::array<Layer, max_layers> layers;
+    size_t num_layers = 0;
+    double time = 0;
+    FloatFrame out;
+    FloatFrame scratch;
+    CMMKProM::led_matrix matrix{};
+
+    static uint8_t to_byte(float v) {
+        return (uint8_t)(std::clamp(v, 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+
+    // Mixes f(dst, src) into the output by the source coverage times the layer opacity,
+    // one channel plane at a time so each loop is a straight vector loop
+    template<typename F>
+    void blend(const FloatFrame &src, float opacity, F f) {
+        alignas(32) float alpha[FloatFrame::padded_cells];
+        for (size_t i = 0; i < FloatFrame::padded_cells; i++)
+            alpha[i] = src.a[i] * opacity;
+
+        auto channel = [&alpha, f](float *__restrict d, const float *__restrict s) {
+            for (size_t i = 0; i < FloatFrame::padded_cells; i++)
+                d[i] += (f(d[i], s[i]) - d[i]) * alpha[i];
+        };
+        channel(out.r, src.r);
+        channel(out.g, src.g);
+        channel(out.b, src.b);
+    }
+};
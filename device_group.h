@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <array>
+#include <bitset>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iostream>
+
+#include "mk_pro_m.h"
+#include "profiler.h"
+#include "rate_controller.h"
+#include "triple_buffer.h"
+
+// Fans rendered frames out to several keyboards. Every board has its own upload
+// worker and triple buffer, so a slow or stalled board only skips frames itself
+// while the others keep up. A board that fails is dropped, the rest carry on: one
+// that is unplugged or fails max_error_frames frames in a row counts as failed.
+class DeviceGroup {
+  public:
+    using LedFrame = std::array<RGB, CMMKProM::num_leds>;
+
+    static const size_t max_error_frames = 20;
+
+    ~DeviceGroup() {
+        stop();
+    }
+
+    // name labels the board's upload worker in the profiler stats and error messages
+    void add(std::unique_ptr<CMMKProM> kb, const std::string &name) {
+        auto device = std::make_unique<Device>();
+        device->kb = std::move(kb);
+        device->name = name;
+        devices.push_back(std::move(device));
+    }
+
+    size_t size() const {
+        return devices.size();
+    }
+
+    CMMKProM &device(size_t i) {
+        return *devices[i]->kb;
+    }
+
+    const std::string &name(size_t i) const {
+        return devices[i]->name;
+    }
+
+    // Upload rate tracking of each board, fed while the workers run
+    const FrameRateController &rate(size_t i) const {
+        return devices[i]->rate;
+    }
+
+    FrameRateController &rate(size_t i) {
+        return devices[i]->rate;
+    }
+
+    // The rate of the fastest working board, slower boards skip the frames they can't take
+    double max_fps() const {
+        double fps = 0;
+        for (auto &device : devices) {
+            if (!device->failed)
+                fps = std::max(fps, device->rate.fps());
+        }
+        return fps;
+    }
+
+    void start() {
+        if (running)
+            return;
+        running = true;
+        for (auto &device : devices) {
+            device->failed = false;
+            device->error_frames = 0;
+            device->worker = std::thread(&DeviceGroup::upload, this, std::ref(*device));
+        }
+    }
+
+    void stop() {
+        running = false;
+        for (auto &device : devices)
+            device->frames.wake_consumer();
+        for (auto &device : devices) {
+            if (device->worker.joinable())
+                device->worker.join();
+        }
+    }
+
+    // Hands num_leds values in packet order to every board, never waits for any of them.
+    // With refresh set, each board sends its next frame in full even if nothing changed.
+    void publish(const RGB *linear_data, bool refresh = false) {
+        for (auto &device : devices) {
+            std::copy(linear_data, linear_data + CMMKProM::num_leds, device->frames.write_buffer().begin());
+            if (refresh)
+                device->refresh = true;
+            device->frames.publish();
+        }
+    }
+
+    bool failed(size_t i) const {
+        return devices[i]->failed;
+    }
+
+    bool all_failed() const {
+        for (auto &device : devices) {
+            if (!device->failed)
+                return false;
+        }
+        return true;
+    }
+
+  private:
+    struct Device {
+        std::unique_ptr<CMMKProM> kb;
+        std::string name;
+        TripleBuffer<LedFrame> frames;
+        std::thread worker;
+        std::atomic<bool> failed{false};
+        std::atomic<bool> refresh{false};
+        // only touched by the completion callback
+        size_t error_frames = 0;
+        FrameRateController rate{CMMKProM::rate_options()};
+    };
+
+    std::vector<std::unique_ptr<Device>> devices;
+    std::atomic<bool> running{false};
+
+    void upload(Device &device) {
+        Profiler::name_thread(("upload " + device.name).c_str());
+        try {
+            device.kb->start_async([&device](const CMMKProM::FrameStatus &status) {
+                device.rate.on_frame(status.elapsed, std::bitset<32>(status.packet_mask).count(), status.error);
+                device.error_frames = status.error != 0 ? device.error_frames + 1 : 0;
+                if (status.error == LIBUSB_ERROR_NO_DEVICE || device.error_frames >= max_error_frames) {
+                    if (!device.failed.exchange(true)) {
+                        std::cerr << "Error: " << device.name << ": upload failed with " << libusb_error_name(status.error)
+                                  << ", " << device.error_frames << " frames in a row" << std::endl;
+                        device.frames.wake_consumer();
+                    }
+                }
+            });
+            while (running && !device.failed) {
+                if (!device.frames.wait_consume(std::chrono::milliseconds(100)))
+                    continue;
+                if (device.refresh.exchange(false))
+                    device.kb->refresh_next_frame();
+                device.kb->set_leds_linear(device.frames.read_buffer().data());
+            }
+            device.kb->stop_async();
+        } catch (std::exception &e) {
+            std::cerr << "Error: " << device.name << ": " << e.what() << std::endl;
+            device.failed = true;
+        }
+    }
+};
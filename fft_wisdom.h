@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fftw3.h>
+
+// FFTW wisdom persisted between runs. It only shortens planning done with FFTW_MEASURE
+// or slower, Spectrum currently plans with FFTW_ESTIMATE and barely gains from it.
+// Wisdom is process wide: load it before the Spectrum is constructed and save it after.
+// The FFTW planner is not thread safe, only the thread that plans may call these.
+struct FftWisdom {
+    // $XDG_CACHE_HOME/mk_pro_m/fftw_wisdom, falling back to ~/.cache, empty if neither is set
+    static std::string default_path() {
+        std::string dir;
+        if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache && *cache)
+            dir = cache;
+        else if (const char *home = std::getenv("HOME"); home && *home)
+            dir = std::string(home) + "/.cache";
+        else
+            return "";
+        return dir + "/mk_pro_m/fftw_wisdom";
+    }
+
+    // Returns false if there is no usable wisdom at path
+    static bool load(const std::string &path) {
+        return fftw_import_wisdom_from_filename(path.c_str()) != 0;
+    }
+
+    // Writes through a temporary file so a concurrent load never sees half of it.
+    // Failing to save only costs the next launch a fresh plan, so errors are returned, not thrown.
+    static bool save(const std::string &path) {
+        const size_t slash = path.rfind('/');
+        if (slash != std::string::npos && slash > 0)
+            make_dirs(path.substr(0, slash));
+
+        const std::string tmp = path + "." + std::to_string(getpid());
+        if (!fftw_export_wisdom_to_filename(tmp.c_str())) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    static void make_dirs(const std::string &dir) {
+        for (size_t pos = dir.find('/', 1); pos != std::string::npos; pos = dir.find('/', pos + 1))
+            mkdir(dir.substr(0, pos).c_str(), 0755);
+        mkdir(dir.c_str(), 0755);
+    }
+};
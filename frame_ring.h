@@ -0,0 +1,318 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "mk_pro_m.h"
+
+// Ring of led_matrix frames in POSIX shared memory, written in place by any number of
+// local producer processes and read by the daemon that owns the keyboard.
+//
+// A producer claims the next slot, fills its matrix directly in the mapping and
+// publishes it; the daemon only ever picks up the newest complete frame. Each slot
+// carries a sequence number that is odd while it is being written, so the daemon
+// can tell a finished frame from one that is still being filled or was overwritten
+// while it was copied. Publishing bumps a futex word the daemon sleeps on, the wake
+// syscall is skipped while the daemon is busy anyway.
+// A producer must not stall halfway through a frame for longer than it takes the
+// others to go round the whole ring.
+// The daemon holds a lock on the ring for as long as it runs, so a second daemon can
+// tell a live ring from one left behind by a daemon that crashed. Daemons create and
+// remove a ring only while holding a second lock for its name, so none can mistake a
+// ring another is still setting up for a stale one. Both sides read the shared header
+// once when mapping it and never trust it again afterwards.
+class FrameRing {
+  public:
+    static const uint32_t ring_magic = 0x4d4b504d;
+    static const uint32_t ring_version = 1;
+    static const size_t default_slots = 8;
+    static constexpr const char *default_name = "/mk_pro_m";
+
+    // Creates the ring for the daemon, replacing a stale one left by a daemon that crashed.
+    // Producers need read and write access, by default only the daemon's user has it.
+    static FrameRing create(const std::string &name, size_t num_slots = default_slots, mode_t mode = 0600) {
+        if (num_slots == 0 || num_slots > UINT32_MAX)
+            throw std::runtime_error("Frame ring needs between 1 and 2^32 - 1 slots");
+
+        NameLock guard(name, mode);
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+        if (fd < 0 && errno == EEXIST) {
+            if (!remove_stale(name))
+                throw std::runtime_error("Frame ring " + name + " is in use by another daemon");
+            fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+        }
+        if (fd < 0)
+            throw_errno("Failed to create frame ring " + name);
+
+        const size_t size = mapping_size(num_slots);
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fchmod(fd, mode) != 0 || ftruncate(fd, size) != 0) {
+            const int error = errno;
+            close(fd);
+            shm_unlink(name.c_str());
+            errno = error;
+            throw_errno("Failed to size frame ring " + name);
+        }
+
+        FrameRing ring(name, fd, size, true, num_slots);
+        ring.header->num_slots = num_slots;
+        ring.header->frame_size = sizeof(CMMKProM::led_matrix);
+        ring.header->version = ring_version;
+        ring.header->magic.store(ring_magic, std::memory_order_release);
+        return ring;
+    }
+
+    // Maps the ring of a running daemon
+    static FrameRing open(const std::string &name = default_name) {
+        const int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            throw_errno("Failed to open frame ring " + name);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+            close(fd);
+            throw std::runtime_error("Frame ring " + name + " is not ready");
+        }
+
+        FrameRing ring(name, fd, st.st_size, false, 0);
+        const Header &h = *ring.header;
+        const size_t num_slots = h.num_slots;
+        if (h.magic.load(std::memory_order_acquire) != ring_magic || h.version != ring_version
+            || h.frame_size != sizeof(CMMKProM::led_matrix) || num_slots == 0 || mapping_size(num_slots) > ring.size)
+            throw std::runtime_error("Frame ring " + name + " has an incompatible layout");
+        ring.slot_count = num_slots;
+        return ring;
+    }
+
+    FrameRing(FrameRing &&other) noexcept
+        : name(std::move(other.name)), size(other.size), owner(other.owner), lock_fd(other.lock_fd),
+          slot_count(other.slot_count), header(other.header), slots(other.slots) {
+        other.header = nullptr;
+        other.owner = false;
+        other.lock_fd = -1;
+    }
+
+    FrameRing(const FrameRing &) = delete;
+    FrameRing &operator=(const FrameRing &) = delete;
+    FrameRing &operator=(FrameRing &&) = delete;
+
+    ~FrameRing() {
+        if (header)
+            munmap(header, size);
+        if (owner) {
+            // without the name lock the ring is left behind, the next daemon removes it as stale
+            try {
+                NameLock guard(name, 0600);
+                unlink_if_ours();
+            } catch (std::runtime_error &) {
+            }
+        }
+        if (lock_fd >= 0)
+            close(lock_fd);
+    }
+
+    size_t num_slots() const {
+        return slot_count;
+    }
+
+    // Producer side: claims the next slot, fill in the returned matrix then publish(seq)
+    CMMKProM::led_matrix &claim(uint64_t &seq) {
+        seq = header->write_seq.fetch_add(1, std::memory_order_relaxed);
+        Slot &slot = slot_for(seq);
+        slot.seq.store(2 * seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return slot.matrix;
+    }
+
+    void publish(uint64_t seq) {
+        slot_for(seq).seq.store(2 * seq + 2, std::memory_order_release);
+        // seq_cst pairs with wait(): either the daemon sees the new count or this sees it sleeping
+        header->wake.fetch_add(1, std::memory_order_seq_cst);
+        if (header->sleeping.load(std::memory_order_seq_cst))
+            futex(&header->wake, FUTEX_WAKE, INT32_MAX, nullptr);
+    }
+
+    void write(const CMMKProM::led_matrix matrix) {
+        uint64_t seq;
+        CMMKProM::led_matrix &slot = claim(seq);
+        std::memcpy(slot, matrix, sizeof(CMMKProM::led_matrix));
+        publish(seq);
+    }
+
+    // Daemon side: copies out the newest complete frame after last_seq and advances
+    // last_seq to it. Returns false if no newer frame has been published.
+    // last_seq starts at 0, frame numbers are 1 based.
+    bool read_latest(uint64_t &last_seq, CMMKProM::led_matrix matrix) {
+        const uint64_t end = header->write_seq.load(std::memory_order_acquire);
+        const uint64_t begin = std::max<uint64_t>(last_seq, end > num_slots() ? end - num_slots() : 0);
+        for (uint64_t seq = end; seq > begin; seq--) {
+            Slot &slot = slot_for(seq - 1);
+            const uint64_t done = 2 * (seq - 1) + 2;
+            if (slot.seq.load(std::memory_order_acquire) != done)
+                continue;
+            std::memcpy(matrix, slot.matrix, sizeof(CMMKProM::led_matrix));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) != done)
+                continue;
+            last_seq = seq;
+            return true;
+        }
+        return false;
+    }
+
+    // Daemon side: sleeps until a producer publishes a frame, at most timeout.
+    // wake_count is the value of wake_counter() taken before the last read_latest.
+    void wait(uint32_t wake_count, std::chrono::milliseconds timeout) {
+        header->sleeping.store(1, std::memory_order_seq_cst);
+        if (header->wake.load(std::memory_order_seq_cst) == wake_count) {
+            const auto s = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+            timespec ts{(time_t)s.count(), (long)std::chrono::nanoseconds(timeout - s).count()};
+            futex(&header->wake, FUTEX_WAIT, wake_count, &ts);
+        }
+        header->sleeping.store(0, std::memory_order_relaxed);
+    }
+
+    uint32_t wake_counter() const {
+        return header->wake.load(std::memory_order_acquire);
+    }
+
+  private:
+    // Held around creating and removing the ring called name, a separate object since
+    // the ring itself may not exist yet. It is never unlinked, so it is never replaced.
+    class NameLock {
+      public:
+        NameLock(const std::string &name, mode_t mode) : fd(shm_open((name + ".lock").c_str(), O_RDWR | O_CREAT, mode)) {
+            if (fd < 0)
+                throw_errno("Failed to open frame ring lock " + name);
+            while (flock(fd, LOCK_EX) != 0) {
+                if (errno != EINTR) {
+                    const int error = errno;
+                    close(fd);
+                    errno = error;
+                    throw_errno("Failed to lock frame ring " + name);
+                }
+            }
+        }
+
+        ~NameLock() {
+            close(fd);
+        }
+
+        NameLock(const NameLock &) = delete;
+        NameLock &operator=(const NameLock &) = delete;
+
+      private:
+        int fd;
+    };
+
+    struct Header {
+        std::atomic<uint32_t> magic;
+        uint32_t version;
+        uint32_t num_slots;
+        uint32_t frame_size;
+        // number of slots claimed so far
+        alignas(64) std::atomic<uint64_t> write_seq;
+        // bumped on every publish, the daemon futex waits on it
+        alignas(64) std::atomic<uint32_t> wake;
+        std::atomic<uint32_t> sleeping;
+    };
+
+    struct alignas(64) Slot {
+        // 2 * frame + 1 while being written, 2 * frame + 2 once complete
+        std::atomic<uint64_t> seq;
+        CMMKProM::led_matrix matrix;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+
+    std::string name;
+    size_t size;
+    bool owner;
+    // the daemon keeps its descriptor open, it carries the lock that marks the ring as live
+    int lock_fd = -1;
+    size_t slot_count;
+    Header *header = nullptr;
+    Slot *slots = nullptr;
+
+    FrameRing(const std::string &name, int fd, size_t size, bool owner, size_t slot_count)
+        : name(name), size(size), owner(owner), slot_count(slot_count) {
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        const int error = errno;
+        if (owner)
+            lock_fd = fd;
+        else
+            close(fd);
+        if (mem == MAP_FAILED) {
+            if (owner) {
+                shm_unlink(name.c_str());
+                close(fd);
+            }
+            errno = error;
+            throw_errno("Failed to map frame ring " + name);
+        }
+        header = static_cast<Header *>(mem);
+        slots = reinterpret_cast<Slot *>(static_cast<uint8_t *>(mem) + slots_offset());
+    }
+
+    static size_t slots_offset() {
+        return (sizeof(Header) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+    }
+
+    static size_t mapping_size(size_t num_slots) {
+        return slots_offset() + num_slots * sizeof(Slot);
+    }
+
+    Slot &slot_for(uint64_t seq) {
+        return slots[seq % slot_count];
+    }
+
+    // Unlinks name if it is still this ring and not one a later daemon created after a
+    // crash made this one look stale. Called with the name lock held.
+    void unlink_if_ours() {
+        const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return;
+        struct stat ours, current;
+        if (fstat(lock_fd, &ours) == 0 && fstat(fd, &current) == 0 && ours.st_dev == current.st_dev
+            && ours.st_ino == current.st_ino)
+            shm_unlink(name.c_str());
+        close(fd);
+    }
+
+    // Unlinks a ring no daemon holds the lock on, returns false if one still does.
+    // Called with the name lock held.
+    static bool remove_stale(const std::string &name) {
+        const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return errno == ENOENT;
+        const bool stale = flock(fd, LOCK_SH | LOCK_NB) == 0;
+        close(fd);
+        if (stale)
+            shm_unlink(name.c_str());
+        return stale;
+    }
+
+    static long futex(std::atomic<uint32_t> *word, int op, uint32_t value, const timespec *timeout) {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), op, value, timeout, nullptr, 0);
+    }
+
+    [[noreturn]] static void throw_errno(const std::string &msg) {
+        throw std::runtime_error(msg + ": " + std::strerror(errno));
+    }
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <ostream>
+
+// Paces a loop on absolute steady_clock deadlines so the frame period does not
+// drift with the time spent doing the work. Deadlines that have already passed
+// when wait() is called are skipped rather than run back to back.
+// Not thread safe, wait() and stats() are meant to be called from the paced thread.
+class FrameScheduler {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    struct Stats {
+        double target_fps = 0;
+        double achieved_fps = 0;
+        uint64_t frames = 0;
+        // deadlines that were skipped because the previous frame overran
+        uint64_t missed = 0;
+        // standard deviation of the time between frames
+        double jitter_ms = 0;
+        // how long after its deadline a frame started, on average and at worst
+        double mean_late_ms = 0;
+        double max_late_ms = 0;
+    };
+
+    // retune() ignores changes of this fraction of the rate or less, and changes made
+    // sooner than retune_interval after the last one
+    static constexpr double retune_threshold = 0.1;
+    static constexpr std::chrono::seconds retune_interval{1};
+
+    explicit FrameScheduler(double fps) {
+        set_fps(fps);
+    }
+
+    // Changes the target rate, the next deadline is one new period from now
+    void set_fps(double fps) {
+        target_fps = fps;
+        period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / fps));
+        next_deadline = clock::now();
+        last_change = next_deadline;
+        reset_stats();
+    }
+
+    // set_fps for a rate that follows a measurement, which would otherwise restart the
+    // deadlines and the stats on every frame. Returns true if the rate was changed.
+    bool retune(double fps) {
+        if (std::fabs(fps - target_fps) <= retune_threshold * target_fps || clock::now() - last_change < retune_interval)
+            return false;
+        set_fps(fps);
+        return true;
+    }
+
+    double fps() const {
+        return target_fps;
+    }
+
+    clock::duration frame_period() const {
+        return period;
+    }
+
+    // Sleeps until the next deadline
+    void wait() {
+        next_deadline += period;
+        const auto now = clock::now();
+        if (now >= next_deadline) {
+            const auto behind = (now - next_deadline) / period + 1;
+            missed += behind;
+            next_deadline += behind * period;
+        }
+
+        std::this_thread::sleep_until(next_deadline);
+        const auto woke = clock::now();
+
+        const double late_ms = std::chrono::duration<double, std::milli>(woke - next_deadline).count();
+        late_sum_ms += late_ms;
+        max_late_ms = std::max(max_late_ms, late_ms);
+
+        if (frames > 0) {
+            // running variance of the frame interval (Welford)
+            const double interval_ms = std::chrono::duration<double, std::milli>(woke - last_wake).count();
+            const double delta = interval_ms - interval_mean;
+            interval_mean += delta / (double)frames;
+            interval_m2 += delta * (interval_ms - interval_mean);
+        }
+        if (frames == 0)
+            first_wake = woke;
+        last_wake = woke;
+        frames++;
+    }
+
+    Stats stats() const {
+        Stats s;
+        s.target_fps = target_fps;
+        s.frames = frames;
+        s.missed = missed;
+        if (frames > 1) {
+            const double elapsed = std::chrono::duration<double>(last_wake - first_wake).count();
+            s.achieved_fps = elapsed > 0 ? (double)(frames - 1) / elapsed : 0;
+            s.jitter_ms = std::sqrt(interval_m2 / (double)(frames - 1));
+        }
+        if (frames > 0) {
+            s.mean_late_ms = late_sum_ms / (double)frames;
+            s.max_late_ms = max_late_ms;
+        }
+        return s;
+    }
+
+    void reset_stats() {
+        frames = 0;
+        missed = 0;
+        late_sum_ms = 0;
+        max_late_ms = 0;
+        interval_mean = 0;
+        interval_m2 = 0;
+    }
+
+  private:
+    double target_fps = 0;
+    clock::duration period{};
+    clock::time_point next_deadline;
+    clock::time_point last_change;
+
+    clock::time_point first_wake;
+    clock::time_point last_wake;
+    uint64_t frames = 0;
+    uint64_t missed = 0;
+    double late_sum_ms = 0;
+    double max_late_ms = 0;
+    double interval_mean = 0;
+    double interval_m2 = 0;
+};
+
+static inline std::ostream &operator<<(std::ostream &os, const FrameScheduler::Stats &s) {
+    return os << "fps = " << s.achieved_fps << "/" << s.target_fps
+              << "; frames = " << s.frames
+              << "; missed = " << s.missed
+              << "; jitter = " << s.jitter_ms << "ms"
+              << "; late = " << s.mean_late_ms << "ms (max " << s.max_late_ms << "ms)";
+}
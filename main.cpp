@@ -2,31 +2,91 @@
 #include <chrono>
 #include <thread>
 #include <algorithm>
+#include <atomic>
+#include <exception>
+#include <array>
+#include <bitset>
+#include <csignal>
+#include <future>
 
 #include "mk_pro_m.h"
-#include "ModularSpec/OpenALDataFetcher.h"
+#include "sim_transport.h"
+#include "device_group.h"
+#include "frame_ring.h"
+#include "compositor.h"
+#include "recording.h"
+#include "triple_buffer.h"
+#include "frame_scheduler.h"
+#include "profiler.h"
+#include "spectrum_bars.h"
+#include "audio_source.h"
+#include "silence_gate.h"
+#include "fft_wisdom.h"
 #include "ModularSpec/Spectrum.h"
 #include "ModularSpec/util.h"
 
 const size_t fft_size = 8192;
 const size_t sample_rate = 44100;
-const size_t num_bars = 30;
-
-constexpr ssize_t matrix_to_bar[CMMKProM::key_map_rows][CMMKProM::key_map_cols] = {
-    //                                    V
-    {27, 26, 21, 20, 15, 14,  9,  8,  3,  2,  3,  8,  9, 14, 15, 20, 21, 26, 27},
-    {28, 25, 22, 19, 16, 13, 10,  7,  4,  1,  4,  7, 10, 13, 16, 19, 22, 25, 28},
-    {29, 24, 23, 18, 17, 12, 11,  6,  5,  0,  5,  6, 11, 12, 17, 18, 23, 24, 29},
-    {29, 24, 23, 18, 17, 12, 11,  6,  5,  0,  5,  6, 11, 12, 17, 18, 23, 24, 29},
-    {28, 25, 22, 19, 16, 13, 10,  7,  4,  1,  4,  7, 10, 13, 16, 19, 22, 25, 28},
-    {27, 26, 21, 20, 15, 14,  9,  8,  3,  2,  3,  8,  9, 14, 15, 20, 21, 26, 27},
+// a hop is at most fft_size samples, OpenALSource buffers half a second
+static_assert(fft_size <= sample_rate / 2);
+
+struct Options {
+    double fps = 40;
+    // follow the rate the keyboards keep up with instead of a fixed fps
+    bool adaptive = false;
+    // new samples per analysis frame, derived from fps when 0
+    size_t hop = 0;
+    // audio file or "-" for stdin, captures from OpenAL when empty
+    std::string input;
+    PcmSource::Format pcm_format;
+    // pace file input at its sample rate instead of reading it as fast as possible
+    bool realtime = false;
+    // stop analysing and uploading while the input is silent
+    bool idle = true;
+    SilenceGate::Options silence;
+    // how often the held frame is resent while idle
+    double keepalive_seconds = 1;
+    bool verbose = false;
+    // normalise and resample in integers, for hosts where float math is slow
+    bool fixed_point = false;
+    // USB port paths or serial numbers of the boards to drive, the first board found if empty
+    std::vector<std::string> devices;
+    bool all_devices = false;
+    // drive simulated boards instead of real ones
+    bool sim = false;
+    size_t sim_boards = 1;
+    SimTransport::Options sim_options;
+    // draw the spectrum over a sweeping wave through the compositor
+    bool wave = false;
+    // record every frame sent to the boards to this file
+    std::string record_path;
+    // stream a recording to the boards instead of analysing audio
+    std::string replay_path;
+    // upload frames other processes write into a shared memory ring instead of analysing audio
+    bool daemon = false;
+    std::string ring_name = FrameRing::default_name;
+    size_t ring_slots = FrameRing::default_slots;
+    // FFTW wisdom file, neither loaded nor saved when empty
+    std::string wisdom_path = FftWisdom::default_path();
+    // append per-stage timing statistics to this file as JSON lines
+    std::string stats_path;
+    std::chrono::milliseconds stats_interval{1000};
 };
 
-void run(CMMKProM &kb) {
-    float audio_data[fft_size];
-    OpenALDataFetcher audio_fetcher(
+// Bars handed from analysis to output. A keep-alive frame is uploaded in full even
+// though it repeats the last one, which delta uploads would otherwise skip.
+struct BarFrame {
+    std::array<uint8_t, num_bars> bars;
+    bool keepalive = false;
+};
+using FrameBuffer = TripleBuffer<BarFrame>;
+
+std::unique_ptr<AudioSource> open_audio(const Options &options) {
+    if (!options.input.empty())
+        return PcmSource::open(options.input, options.pcm_format);
+
+    return std::make_unique<OpenALSource>(
         sample_rate,
-        fft_size,
         [](const std::vector<std::string> &list) {
             // try to find "Monitor of Built-in Audio Analog Stereo"
             for (size_t i = 0; i < list.size(); ++i) {
@@ -40,51 +100,579 @@ void run(CMMKProM &kb) {
             return (size_t)0;
         }
     );
+}
 
+// Analyses a frame every hop new samples, stops everything once the input ends.
+// Without a fixed --hop the hop follows target_fps, which the output side may retune.
+// While the input is silent the spectrum is skipped, the last frame fades out and is
+// then only republished as a keep-alive that every board sends in full; the first loud
+// hop resumes analysis.
+void analyse(
+    const Options &options,
+    AudioSource &source,
+    FrameBuffer &frames,
+    const std::atomic<double> &target_fps,
+    std::atomic<bool> &running,
+    StartupTimer &startup
+) {
+    Profiler::name_thread("analysis");
+    const size_t rate = source.sample_rate();
+    auto hop_for = [&](double fps) {
+        return options.hop ? options.hop : std::clamp<size_t>(std::lround(rate / fps), 1, fft_size);
+    };
+    size_t hop = hop_for(target_fps);
+    const bool paced = options.realtime && !options.input.empty();
+
+    SampleWindow window(fft_size);
+    std::vector<float> hop_data(std::max(hop, fft_size));
+    float audio_data[fft_size];
+
+    // Spectrum plans with FFTW_ESTIMATE, which gains little from wisdom, so loading it is
+    // timed on its own and the plan is never reported as cached
+    bool have_wisdom = false;
+    if (!options.wisdom_path.empty()) {
+        StartupTimer::Phase phase(startup, "fftw wisdom");
+        have_wisdom = FftWisdom::load(options.wisdom_path);
+        if (!have_wisdom)
+            phase.rename("fftw wisdom (none found)");
+    }
+    StartupTimer::Phase plan_phase(startup, "fft plan");
     Spectrum spec(fft_size);
+    plan_phase.end();
+    if (!options.wisdom_path.empty() && !have_wisdom && !FftWisdom::save(options.wisdom_path))
+        std::cerr << "Failed to save FFTW wisdom to " << options.wisdom_path << std::endl;
     spec.UseLinearNormalisation(1, num_bars * 2);
     spec.average_weight = 0.7;
     spec.scale = 1;
 
-    const float avg_max_weight = 0.8f;
-    float avg_max = 0;
+    BarNormaliser normaliser;
     float bar_data[num_bars];
-    uint8_t out_bar_data[num_bars];
-    CMMKProM::led_matrix matrix{};
-    while (1) {
-        audio_fetcher.UpdateData();
-        audio_fetcher.GetData(audio_data);
-        spec.Update(audio_data);
-        spec.GetData(50, 2500, sample_rate, bar_data, num_bars);
-
-        const float scale = std::clamp(1 / std::max(avg_max, 0.1f), 1.f, 10.f);
-        float max = 0;
-        for (size_t i = 0; i < num_bars; i++) {
-            float val = std::pow(bar_data[i], 1.5f);
-            max = std::max(max, val);
-            out_bar_data[i] = (uint8_t)(std::clamp(val * scale * 255.0f, 1.0f, 255.0f));
+    uint8_t bars[num_bars]{};
+    SilenceGate gate(options.silence, rate);
+    uint64_t idle_samples = 0;
+    // only paces file input, live capture is paced by the samples arriving
+    FrameScheduler scheduler((double)rate / hop);
+    uint64_t analysed = 0;
+    auto last_report = FrameScheduler::clock::now();
+    while (running) {
+        size_t count;
+        {
+            StageTimer timer(Stage::AudioUpdate);
+            count = source.read(hop_data.data(), hop);
         }
-        avg_max = avg_max_weight * avg_max + (1.f - avg_max_weight) * max;
-        // std::cout << "max = " << max << "; avg = " << avg_max << "; scale = " << scale << std::endl;
+        if (count == 0)
+            break;
+        window.push(hop_data.data(), count);
+
+        const bool was_silent = gate.is_silent();
+        const bool silent = options.idle && gate.update(hop_data.data(), count);
+        if (options.verbose && silent != was_silent)
+            std::cout << (silent ? "input silent, idling" : "input active") << std::endl;
 
-        for (size_t x = 0; x < CMMKProM::key_map_cols; x++) {
-            for (size_t y = 0; y < CMMKProM::key_map_rows; y++) {
-                matrix[y][x].r = out_bar_data[matrix_to_bar[y][x]];
+        if (silent) {
+            // fade out over a few frames, then resend the dark frame as a keep-alive
+            bool lit = false;
+            for (uint8_t &bar : bars) {
+                bar = bar * 7 / 8;
+                lit |= bar > 0;
             }
+            idle_samples += count;
+            if (lit || idle_samples >= options.keepalive_seconds * rate) {
+                idle_samples = 0;
+                BarFrame &frame = frames.write_buffer();
+                std::copy(bars, bars + num_bars, frame.bars.begin());
+                frame.keepalive = !lit;
+                frames.publish();
+            }
+        } else {
+            idle_samples = 0;
+            {
+                StageTimer timer(Stage::AudioGet);
+                window.copy_to(audio_data);
+            }
+            {
+                StageTimer timer(Stage::SpectrumUpdate);
+                spec.Update(audio_data);
+            }
+            {
+                StageTimer timer(Stage::SpectrumGet);
+                spec.GetData(50, 2500, rate, bar_data, num_bars);
+            }
+            {
+                StageTimer timer(Stage::BarMapping);
+                if (options.fixed_point)
+                    normaliser.normalise_fixed(bar_data, bars);
+                else
+                    normaliser.normalise(bar_data, bars);
+            }
+            BarFrame &frame = frames.write_buffer();
+            std::copy(bars, bars + num_bars, frame.bars.begin());
+            frame.keepalive = false;
+            frames.publish();
+            analysed++;
+        }
+
+        const auto now = FrameScheduler::clock::now();
+        if (options.verbose && now - last_report >= std::chrono::seconds(10)) {
+            if (paced) {
+                std::cout << "analysis: " << scheduler.stats() << std::endl;
+                scheduler.reset_stats();
+            } else {
+                const double seconds = std::chrono::duration<double>(now - last_report).count();
+                std::cout << "analysis: " << analysed / seconds << " fps, hop " << hop << " samples" << std::endl;
+            }
+            analysed = 0;
+            last_report = now;
+        }
+
+        const size_t next_hop = hop_for(target_fps);
+        if (next_hop != hop && scheduler.retune((double)rate / next_hop))
+            hop = next_hop;
+        if (paced)
+            scheduler.wait();
+    }
+    running = false;
+    frames.wake_consumer();
+}
+
+void open_devices(const Options &options, DeviceGroup &devices) {
+    if (options.sim) {
+        for (size_t i = 0; i < options.sim_boards; i++) {
+            SimTransport::Options sim_options = options.sim_options;
+            sim_options.seed += i;
+            devices.add(std::make_unique<CMMKProM>(std::make_unique<SimTransport>(sim_options)), "sim" + std::to_string(i));
         }
+        return;
+    }
 
-        kb.set_leds_smooth(matrix);
+    std::vector<std::string> selectors = options.devices;
+    if (options.all_devices) {
+        for (const auto &info : CMMKProM::list_devices())
+            selectors.push_back(info.port_path);
+        if (selectors.empty())
+            throw std::runtime_error("No keyboards found");
+    }
+    if (selectors.empty()) {
+        devices.add(std::make_unique<CMMKProM>(), "usb");
+        return;
+    }
+    // bring the boards up at the same time, each one takes several USB round trips
+    std::vector<std::future<std::unique_ptr<CMMKProM>>> opening;
+    for (const auto &selector : selectors)
+        opening.push_back(std::async(std::launch::async, [&selector]() { return std::make_unique<CMMKProM>(selector); }));
+    for (size_t i = 0; i < selectors.size(); i++)
+        devices.add(opening[i].get(), selectors[i]);
+}
+
+// Renders the latest analysed bars once whenever they change and hands them to every board,
+// each board uploads at whatever rate it manages. Waits for devices_ready before the first frame.
+void output(
+    const Options &options,
+    DeviceGroup &devices,
+    std::future<void> &devices_ready,
+    FrameBuffer &frames,
+    std::atomic<double> &target_fps,
+    const std::atomic<bool> &running,
+    StartupTimer &startup
+) {
+    Profiler::name_thread("output");
+    std::unique_ptr<FrameRecorder> recorder;
+    if (!options.record_path.empty())
+        recorder = std::make_unique<FrameRecorder>(options.record_path);
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(25));
+    Compositor compositor;
+    if (options.wave) {
+        compositor.add_layer(std::make_unique<WaveEffect>(Color{0, 0.2f, 1}), BlendMode::Normal, 0.4f);
+        compositor.add_layer(std::make_unique<SpectrumEffect>(Color{1, 0, 0}), BlendMode::Screen);
     }
+    const auto start = std::chrono::steady_clock::now();
+
+    devices_ready.get();
+    devices.start();
+    CMMKProM::led_matrix matrix;
+    RGB linear_data[CMMKProM::num_leds];
+    bool first_frame = true;
+    auto last_report = std::chrono::steady_clock::now();
+    while (running) {
+        if (options.adaptive)
+            target_fps = devices.max_fps();
+        if (options.verbose && std::chrono::steady_clock::now() - last_report >= std::chrono::seconds(10)) {
+            for (size_t i = 0; i < devices.size(); i++) {
+                std::cout << devices.name(i) << ": " << devices.rate(i).stats() << std::endl;
+                devices.rate(i).reset_stats();
+            }
+            last_report = std::chrono::steady_clock::now();
+        }
 
+        // sleeps through silence, when only keep-alive frames arrive
+        if (!frames.wait_consume(std::chrono::milliseconds(100)))
+            continue;
+        {
+            StageTimer timer(Stage::Render);
+            const uint8_t *bars = frames.read_buffer().bars.data();
+            if (compositor.size() > 0) {
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                compositor.render({elapsed.count(), bars}, matrix);
+                if (options.fixed_point)
+                    CMMKProM::resample_fixed(matrix, linear_data, true);
+                else
+                    CMMKProM::resample(matrix, linear_data, true);
+            } else if (options.fixed_point) {
+                CMMKProM::render_bars(bars, fixed_bar_key_table, linear_data);
+            } else {
+                CMMKProM::render_bars(bars, bar_key_table, linear_data);
+            }
+        }
+        devices.publish(linear_data, frames.read_buffer().keepalive);
+        if (first_frame) {
+            startup.mark("first frame");
+            if (options.verbose)
+                startup.report(std::cout);
+            first_frame = false;
+        }
+        if (recorder)
+            recorder->write(frames.read_buffer().bars.data(), linear_data);
+        if (devices.all_failed())
+            throw std::runtime_error("All keyboards failed");
+    }
+    devices.stop();
+}
+
+std::atomic<bool> stop_requested{false};
+
+void request_stop(int) {
+    stop_requested = true;
 }
 
-int main() {
+// Uploads the newest frame producers have written into the shared frame ring, see frame_ring.h
+void serve(const Options &options, DeviceGroup &devices) {
+    Profiler::name_thread("daemon");
+    FrameRing ring = FrameRing::create(options.ring_name, options.ring_slots);
+    std::unique_ptr<FrameRecorder> recorder;
+    if (!options.record_path.empty())
+        recorder = std::make_unique<FrameRecorder>(options.record_path);
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+
+    devices.start();
+    CMMKProM::led_matrix matrix;
+    RGB linear_data[CMMKProM::num_leds];
+    uint64_t last_seq = 0;
+    while (!stop_requested) {
+        const uint32_t wake_count = ring.wake_counter();
+        if (!ring.read_latest(last_seq, matrix)) {
+            ring.wait(wake_count, std::chrono::milliseconds(100));
+            continue;
+        }
+        {
+            StageTimer timer(Stage::Render);
+            if (options.fixed_point)
+                CMMKProM::resample_fixed(matrix, linear_data, true);
+            else
+                CMMKProM::resample(matrix, linear_data, true);
+        }
+        devices.publish(linear_data);
+        if (recorder)
+            recorder->write(nullptr, linear_data);
+        if (devices.all_failed())
+            throw std::runtime_error("All keyboards failed");
+    }
+    devices.stop();
+}
+
+// Uploads every frame of a recording to each board, as fast as the board takes them
+// or at the recorded pace, and reports the throughput each board achieved
+void replay(const Options &options, DeviceGroup &devices) {
+    const FrameRecording recording(options.replay_path);
+    std::signal(SIGINT, request_stop);
+    std::signal(SIGTERM, request_stop);
+
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> errors(devices.size());
+    std::vector<std::string> reports(devices.size());
+    for (size_t i = 0; i < devices.size(); i++) {
+        workers.emplace_back([&, i]() {
+            try {
+                Profiler::name_thread(("replay " + devices.name(i)).c_str());
+                CMMKProM &kb = devices.device(i);
+                std::atomic<uint64_t> packets{0};
+                kb.start_async([&packets](const CMMKProM::FrameStatus &status) {
+                    packets += std::bitset<32>(status.packet_mask).count();
+                });
+
+                FrameRecording::Reader reader(recording);
+                FrameRecording::Frame frame;
+                uint64_t count = 0;
+                const auto start = std::chrono::steady_clock::now();
+                while (!stop_requested && reader.next(frame)) {
+                    if (options.realtime)
+                        std::this_thread::sleep_until(start + frame.time);
+                    kb.set_leds_linear(frame.leds);
+                    count++;
+                }
+                kb.wait_frame();
+                kb.stop_async();
+
+                const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                reports[i] = devices.name(i) + ": " + std::to_string(count) + " frames in " + std::to_string(seconds)
+                    + " s, " + std::to_string(count / seconds) + " fps, "
+                    + std::to_string(packets / seconds) + " reports/s, "
+                    + std::to_string(packets * CMMKProM::packet_size / seconds / 1000.0) + " kB/s";
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+
+    for (const auto &report : reports) {
+        if (!report.empty())
+            std::cout << report << std::endl;
+    }
+    for (auto &error : errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+void run(
+    const Options &options,
+    AudioSource &source,
+    DeviceGroup &devices,
+    std::future<void> &devices_ready,
+    StartupTimer &startup
+) {
+    FrameBuffer frames;
+    std::atomic<double> target_fps{options.adaptive ? FrameRateController::Options{}.min_fps : options.fps};
+    std::atomic<bool> running{true};
+    std::exception_ptr errors[2];
+
+    // stop both threads if either one fails, the error is rethrown once they have exited
+    auto guarded = [&running, &frames](std::exception_ptr &error, auto f) {
+        return [&running, &frames, &error, f]() {
+            try {
+                f();
+            } catch (...) {
+                error = std::current_exception();
+                running = false;
+                frames.wake_consumer();
+            }
+        };
+    };
+
+    std::thread analysis_thread(guarded(errors[0], [&]() {
+        analyse(options, source, frames, target_fps, running, startup);
+    }));
+    std::thread output_thread(guarded(errors[1], [&]() {
+        output(options, devices, devices_ready, frames, target_fps, running, startup);
+    }));
+    analysis_thread.join();
+    output_thread.join();
+
+    for (auto &error : errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+// SIGUSR1 switches stage timing on and off while running
+void toggle_profiler(int) {
+    Profiler &profiler = Profiler::instance();
+    profiler.set_enabled(!profiler.enabled());
+}
+
+void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [options]\n"
+              << "  --fps N|auto  target analysis frame rate (default 40), auto follows the fastest\n"
+              << "                rate the keyboards acknowledge uploads at\n"
+              << "  --hop N       analyse a frame every N new samples, from 1 to the FFT size (8192)\n"
+              << "                (default sample rate / fps)\n"
+              << "  --input FILE  read a WAV file, or raw PCM when it has no RIFF header, instead of\n"
+              << "                capturing from OpenAL, - reads stdin\n"
+              << "  --pcm-format s16|f32\n"
+              << "  --pcm-channels N\n"
+              << "  --pcm-rate N  sample format of raw PCM input (default s16, 2 channels, 44100)\n"
+              << "  --silence-db DB\n"
+              << "                input level below which it counts as silent (default -60)\n"
+              << "  --idle-after S\n"
+              << "                seconds of silence before analysis and uploads stop (default 2)\n"
+              << "  --no-idle     keep analysing and uploading through silence\n"
+              << "  --realtime    pace file input at its sample rate and replays at the recorded pace\n"
+              << "  -v, --verbose print frame timing and upload rate statistics every 10 seconds\n"
+              << "  --fixed-point normalise and render in integer arithmetic, within one step of\n"
+              << "                the float path and faster where float math is slow\n"
+              << "  --device ID   drive the keyboard with this USB port path (eg 1-2.3) or serial,\n"
+              << "                can be repeated to drive several (default the first one found)\n"
+              << "  --all-devices drive every keyboard found\n"
+              << "  --list-devices\n"
+              << "                print the port path and serial of every keyboard found\n"
+              << "  --sim         use a simulated keyboard instead of the USB device\n"
+              << "  --sim-boards N\n"
+              << "                number of simulated keyboards (default 1)\n"
+              << "  --sim-latency US\n"
+              << "                per report latency of the simulated keyboard\n"
+              << "  --sim-drop P  probability that the simulated keyboard drops an LED report\n"
+              << "  --wave        draw the spectrum over a sweeping wave\n"
+              << "  --record FILE record every frame sent to the keyboards\n"
+              << "  --replay FILE upload a recording to the keyboards and report the throughput\n"
+              << "  --daemon      instead of analysing audio, upload the frames other processes\n"
+              << "                write into a shared memory frame ring\n"
+              << "  --ring NAME   shared memory name of the frame ring (default /mk_pro_m)\n"
+              << "  --ring-slots N\n"
+              << "                number of frames in the ring (default 8)\n"
+              << "  --wisdom FILE load FFTW wisdom from FILE before planning, save it there if\n"
+              << "                none was found (default ~/.cache/mk_pro_m/fftw_wisdom)\n"
+              << "  --no-wisdom   neither load nor save FFTW wisdom\n"
+              << "  --stats FILE  append per-stage timing histograms to FILE as JSON lines,\n"
+              << "                SIGUSR1 toggles recording\n"
+              << "  --stats-interval MS\n"
+              << "                how often the statistics are written (default 1000)\n";
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    try {
+        for (int i = 1; i < argc; i++) {
+            const std::string arg = argv[i];
+            if (arg == "--fps" && i + 1 < argc) {
+                const std::string fps = argv[++i];
+                options.adaptive = fps == "auto";
+                if (!options.adaptive)
+                    options.fps = std::stod(fps);
+            } else if (arg == "--hop" && i + 1 < argc) {
+                options.hop = std::stoul(argv[++i]);
+                if (options.hop == 0)
+                    throw std::invalid_argument("--hop");
+            } else if (arg == "--input" && i + 1 < argc) {
+                options.input = argv[++i];
+            } else if (arg == "--pcm-format" && i + 1 < argc) {
+                const std::string format = argv[++i];
+                if (format != "s16" && format != "f32") {
+                    usage(argv[0]);
+                    return 1;
+                }
+                options.pcm_format.encoding = format == "s16" ? PcmSource::Encoding::S16 : PcmSource::Encoding::F32;
+            } else if (arg == "--pcm-channels" && i + 1 < argc) {
+                options.pcm_format.channels = std::stoul(argv[++i]);
+            } else if (arg == "--pcm-rate" && i + 1 < argc) {
+                options.pcm_format.rate = std::stoul(argv[++i]);
+            } else if (arg == "--silence-db" && i + 1 < argc) {
+                options.silence.threshold_db = std::stod(argv[++i]);
+            } else if (arg == "--idle-after" && i + 1 < argc) {
+                options.silence.hold_seconds = std::stod(argv[++i]);
+            } else if (arg == "--no-idle") {
+                options.idle = false;
+            } else if (arg == "--realtime") {
+                options.realtime = true;
+            } else if (arg == "-v" || arg == "--verbose") {
+                options.verbose = true;
+            } else if (arg == "--fixed-point") {
+                options.fixed_point = true;
+            } else if (arg == "--device" && i + 1 < argc) {
+                options.devices.push_back(argv[++i]);
+            } else if (arg == "--all-devices") {
+                options.all_devices = true;
+            } else if (arg == "--list-devices") {
+                try {
+                    for (const auto &info : CMMKProM::list_devices())
+                        std::cout << info.port_path << (info.serial.empty() ? "" : " " + info.serial) << std::endl;
+                } catch (std::runtime_error &e) {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                    return 1;
+                }
+                return 0;
+            } else if (arg == "--sim-boards" && i + 1 < argc) {
+                options.sim_boards = std::stoul(argv[++i]);
+            } else if (arg == "--sim") {
+                options.sim = true;
+            } else if (arg == "--sim-latency" && i + 1 < argc) {
+                options.sim_options.latency = std::chrono::microseconds(std::stol(argv[++i]));
+            } else if (arg == "--sim-drop" && i + 1 < argc) {
+                options.sim_options.drop_rate = std::stod(argv[++i]);
+            } else if (arg == "--wave") {
+                options.wave = true;
+            } else if (arg == "--record" && i + 1 < argc) {
+                options.record_path = argv[++i];
+            } else if (arg == "--replay" && i + 1 < argc) {
+                options.replay_path = argv[++i];
+            } else if (arg == "--daemon") {
+                options.daemon = true;
+            } else if (arg == "--ring" && i + 1 < argc) {
+                options.ring_name = argv[++i];
+            } else if (arg == "--ring-slots" && i + 1 < argc) {
+                options.ring_slots = std::stoul(argv[++i]);
+            } else if (arg == "--wisdom" && i + 1 < argc) {
+                options.wisdom_path = argv[++i];
+            } else if (arg == "--no-wisdom") {
+                options.wisdom_path.clear();
+            } else if (arg == "--stats" && i + 1 < argc) {
+                options.stats_path = argv[++i];
+            } else if (arg == "--stats-interval" && i + 1 < argc) {
+                options.stats_interval = std::chrono::milliseconds(std::stol(argv[++i]));
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    } catch (std::logic_error &) {
+        // a number failed to parse, or --hop was 0
+        usage(argv[0]);
+        return 1;
+    }
+    if (!(options.fps > 0)) {
+        std::cerr << "Error: --fps must be positive" << std::endl;
+        return 1;
+    }
+    if (options.hop > fft_size) {
+        std::cerr << "Error: --hop must be at most the FFT size, " << fft_size << std::endl;
+        return 1;
+    }
+    if (options.pcm_format.channels == 0 || options.pcm_format.rate == 0) {
+        std::cerr << "Error: --pcm-channels and --pcm-rate must be positive" << std::endl;
+        return 1;
+    }
+    if (!(options.silence.hold_seconds >= 0)) {
+        std::cerr << "Error: --idle-after must not be negative" << std::endl;
+        return 1;
+    }
+    if (options.ring_slots == 0) {
+        std::cerr << "Error: --ring-slots must be positive" << std::endl;
+        return 1;
+    }
+    if (options.stats_interval.count() <= 0) {
+        std::cerr << "Error: --stats-interval must be positive" << std::endl;
+        return 1;
+    }
+
     try {
-        CMMKProM kb;
-        run(kb);
-        // kb.do_thing();
+        if (!options.stats_path.empty()) {
+            Profiler::instance().start_export(options.stats_path, options.stats_interval);
+            std::signal(SIGUSR1, toggle_profiler);
+        }
+        DeviceGroup devices;
+        if (!options.replay_path.empty()) {
+            open_devices(options, devices);
+            replay(options, devices);
+        } else if (options.daemon) {
+            open_devices(options, devices);
+            serve(options, devices);
+        } else {
+            // the keyboards come up while the audio input is opened and the FFT planned,
+            // the output thread waits for them before the first frame
+            StartupTimer startup;
+            std::future<void> devices_ready = std::async(std::launch::async, [&]() {
+                StartupTimer::Phase phase(startup, "devices");
+                open_devices(options, devices);
+            });
+            std::unique_ptr<AudioSource> source;
+            {
+                StartupTimer::Phase phase(startup, "audio");
+                source = open_audio(options);
+            }
+            run(options, *source, devices, devices_ready, startup);
+        }
+        Profiler::instance().stop_export();
     } catch (std::runtime_error &e) {
         std::cerr << "Error: " << e.what() << std::endl;
     }
@@ -2,14 +2,39 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <chrono>
 #include <thread>
 #include <string>
+#include <vector>
 #include <algorithm>
 #include <cmath>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
-#include <libusb-1.0/libusb.h>
+#include <memory>
+#include <bitset>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "frame_scheduler.h"
+#include "profiler.h"
+#include "rate_controller.h"
+#include "transport.h"
+#include "usb_transport.h"
+
+// Keeps float sums in source order and unfused even under -Ofast, for loops that must
+// round exactly like summing key_scales in order. Clang uses STRICT_FLOAT_BODY instead.
+#if defined(__GNUC__) && !defined(__clang__)
+#define STRICT_FLOAT __attribute__((optimize("no-associative-math", "no-unsafe-math-optimizations", "fp-contract=off")))
+#define STRICT_FLOAT_BODY
+#else
+#define STRICT_FLOAT
+#define STRICT_FLOAT_BODY _Pragma("clang fp reassociate(off) contract(off)")
+#endif
 
 #pragma pack(push, 1)
 struct RGB {
@@ -29,7 +54,7 @@ static inline double map(double n, double min1, double max1, double min2, double
 template<typename T, size_t N>
 struct MakeArray {
     T arr[N];
-    static const size_t size = N;
+    static constexpr size_t size = N;
 
     template<typename F>
     constexpr MakeArray(F f) : arr() {
@@ -49,15 +74,87 @@ struct KeyScales {
     CellScale cell_scales[N];
 };
 
-class CMMKProM {
-  public:
-    static const int usb_interface = 1;
-    static const unsigned char usb_endpoint_out = 4 | LIBUSB_ENDPOINT_OUT;
-    static const unsigned char usb_endpoint_in = 3 | LIBUSB_ENDPOINT_IN;
+// KeyScales of every key flattened into a blocked sparse table for SIMD resampling.
+// LEDs are processed Lanes at a time; group g owns the entries
+// [group_offsets[g], group_offsets[g + 1]) and entry j holds the j-th cell of every
+// LED in the group, with a zero weight where an LED covers fewer cells.
+// LEDs are grouped by how many cells they cover to keep that padding small, leds
+// holds the position in the packets each lane is written to.
+template<size_t NumLeds, size_t Lanes, size_t NumEntries>
+struct ResampleTable {
+    static constexpr size_t lanes = Lanes;
+    static constexpr size_t num_groups = NumLeds / Lanes;
+    static constexpr size_t num_entries = NumEntries;
+    static_assert(NumLeds % Lanes == 0);
 
-    static const size_t key_map_cols = 19;
-    static const size_t key_map_rows = 6;
-    using led_matrix = RGB[key_map_rows][key_map_cols];
+    uint16_t group_offsets[num_groups + 1]{};
+    uint8_t leds[num_groups][Lanes]{};
+    // byte offset of the cell in the flattened key map matrix
+    uint16_t cells[NumEntries][Lanes]{};
+    float weights[NumEntries][Lanes]{};
+};
+
+// ResampleTable with the weights quantised to Q14 for the integer resampling path.
+// A byte and a weight each fit in a signed 16 bit operand, a weight of 1.0 included,
+// so the kernels multiply with madd_epi16 and accumulate in 32 bits.
+template<size_t NumLeds, size_t Lanes, size_t NumEntries>
+struct FixedResampleTable {
+    static constexpr size_t lanes = Lanes;
+    static constexpr size_t num_groups = NumLeds / Lanes;
+    static constexpr size_t num_entries = NumEntries;
+    static constexpr int weight_bits = 14;
+
+    uint16_t group_offsets[num_groups + 1]{};
+    uint8_t leds[num_groups][Lanes]{};
+    uint16_t cells[NumEntries][Lanes]{};
+    int16_t weights[NumEntries][Lanes]{};
+};
+
+template<size_t NumLeds, size_t Lanes, size_t NumEntries>
+constexpr auto quantise(const ResampleTable<NumLeds, Lanes, NumEntries> &table) {
+    FixedResampleTable<NumLeds, Lanes, NumEntries> fixed{};
+    for (size_t g = 0; g <= fixed.num_groups; g++)
+        fixed.group_offsets[g] = table.group_offsets[g];
+    for (size_t g = 0; g < fixed.num_groups; g++)
+        for (size_t lane = 0; lane < Lanes; lane++)
+            fixed.leds[g][lane] = table.leds[g][lane];
+    for (size_t e = 0; e < NumEntries; e++)
+        for (size_t lane = 0; lane < Lanes; lane++)
+            fixed.cells[e][lane] = table.cells[e][lane];
+
+    // Rounds each LED's running sum rather than each weight, so its weights add up to its
+    // float total rounded once and a key showing 255 in every cell still comes out at 255
+    const double one = (double)(1 << fixed.weight_bits);
+    for (size_t g = 0; g < fixed.num_groups; g++) {
+        for (size_t lane = 0; lane < Lanes; lane++) {
+            double sum = 0;
+            int32_t rounded = 0;
+            for (size_t e = table.group_offsets[g]; e < table.group_offsets[g + 1]; e++) {
+                sum += table.weights[e][lane];
+                const int32_t next = (int32_t)(sum * one + 0.5);
+                fixed.weights[e][lane] = (int16_t)std::min(next - rounded, (int32_t)INT16_MAX);
+                rounded = next;
+            }
+        }
+    }
+    return fixed;
+}
+
+// Describes one MasterKeys model: how to reach it over USB and where its keys are.
+// CMMKDevice derives every table it needs from these at compile time.
+struct ProMLayout {
+    static constexpr uint16_t usb_vendor_id = 0x2516;
+    static constexpr uint16_t usb_product_id = 0x0048;
+    static constexpr int usb_interface = 1;
+    static constexpr unsigned char usb_endpoint_out = 4 | LIBUSB_ENDPOINT_OUT;
+    static constexpr unsigned char usb_endpoint_in = 3 | LIBUSB_ENDPOINT_IN;
+    static constexpr unsigned int usb_timeout_ms = 100;
+    static constexpr size_t packet_size = 64;
+    static constexpr size_t num_packets = 7;
+    static constexpr size_t leds_per_packet = 16;
+
+    static constexpr size_t key_map_cols = 19;
+    static constexpr size_t key_map_rows = 6;
     // mapping of matrix positions to index in data stream
     static constexpr ssize_t key_map[key_map_rows][key_map_cols] = {
         /*
@@ -79,14 +176,76 @@ class CMMKProM {
          LCL  LWN       LAL            SPC                 RAL  RWN   FN       RCL   KP0  K00  KP.     */
         {  5,  13, -1 ,  21, -1 , -1 ,  53, -1 , -1 , -1 ,  77,  85,  93, -1 , 101,    6,  14,  7, -1 },
     };
-    static const size_t num_keys = []() constexpr -> size_t {
+
+    static constexpr size_t big_key_map_rows = key_map_rows;
+    static constexpr size_t big_key_map_cols = key_map_cols * 4;
+    // Bigger version of the above keymap that takes into account the physical positions of the keys
+    // The keys on the board come in quarter sizes (eg the CTRL keys are 1.25 units wide)
+    static constexpr ssize_t big_key_map[big_key_map_rows][big_key_map_cols] = {
+        /*
+         |       ESC      |                      |       F1       |  |       F2       |  |       F3       |  |       F4       |            |       F5       |  |       F6       |  |       F7       |  |       F8       |            |       F9       |  |       F10      |  |       F11      |  |       F12      |                                                                                 */
+        {  0,   0,   0,   0,  -1,  -1,  -1,  -1,   8,   8,   8,   8,  16,  16,  16,  16,  24,  24,  24,  24,  32,  32,  32,  32,  -1,  -1,  40,  40,  40,  40,  48,  48,  48,  48,  56,  56,  56,  56,  64,  64,  64,  64,  -1,  -1,  72,  72,  72,  72,  80,  80,  80,  80,  88,  88,  88,  88,  96,  96,  96,  96,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1},
+        /*
+         |        ~       |  |        1       |  |        2       |  |        3       |  |        4       |  |        5       |  |        6       |  |        7       |  |        8       |  |        9       |  |        0       |  |       -_       |  |       =+       |  |              BACKSPACE             |  |     NUMLOCK    |  |      KP /      |  |      KP *      |  |      KP -      | */
+        {  1,   1,   1,   1,   9,   9,   9,   9,  17,  17,  17,  17,  25,  25,  25,  25,  33,  33,  33,  33,  41,  41,  41,  41,  49,  49,  49,  49,  57,  57,  57,  57,  65,  65,  65,  65,  73,  73,  73,  73,  81,  81,  81,  81,  89,  89,  89,  89,  97,  97,  97,  97, 104, 104, 104, 104, 104, 104, 104, 104, 109, 109, 109, 109,  70,  70,  70,  70,  63,  63,  63,  63,  71,  71,  71,  71},
+        /*
+         |            TAB           |  |        Q       |  |        W       |  |        E       |  |        R       |  |        T       |  |        Y       |  |        U       |  |        I       |  |        O       |  |        P       |  |        [       |  |        ]       |  |            \|            |  |      KP 7      |  |      KP 8      |  |      KP 9      |  |      KP +      | */
+        {  2,   2,   2,   2,   2,   2,  10,  10,  10,  10,  18,  18,  18,  18,  26,  26,  26,  26,  34,  34,  34,  34,  42,  42,  42,  42,  50,  50,  50,  50,  58,  58,  58,  58,  66,  66,  66,  66,  74,  74,  74,  74,  82,  82,  82,  82,  90,  90,  90,  90,  98,  98,  98,  98, 106, 106, 106, 106, 106, 106,  54,  54,  54,  54,  62,  62,  62,  62,  55,  55,  55,  55,  47,  47,  47,  47},
+        /*
+         |            CAPSLOCK           |  |        A       |  |        S       |  |        D       |  |        F       |  |        G       |  |        H       |  |        J       |  |        K       |  |        L       |  |       ;:       |  |       '"       |  |                  ENTER                  |  |      KP 4      |  |      KP 5      |  |      KP 6      |  |      KP +      | */
+        {  3,   3,   3,   3,   3,   3,   3,  11,  11,  11,  11,  19,  19,  19,  19,  27,  27,  27,  27,  35,  35,  35,  35,  43,  43,  43,  43,  51,  51,  51,  51,  59,  59,  59,  59,  67,  67,  67,  67,  75,  75,  75,  75,  83,  83,  83,  83,  91,  91,  91,  91, 107, 107, 107, 107, 107, 107, 107, 107, 107,  38,  38,  38,  38,  46,  46,  46,  46,  31,  31,  31,  31,  47,  47,  47,  47},
+        /*
+         |                  LSHIFT                 |  |        Z       |  |        X       |  |        C       |  |        V       |  |        B       |  |        N       |  |        M       |  |       ,<       |  |       .>       |  |       /?       |  |                       RSHIFT                      |  |      KP 1      |  |      KP 2      |  |      KP 3      |  |    KP ENTER    | */
+        {  4,   4,   4,   4,   4,   4,   4,   4,   4,  20,  20,  20,  20,  28,  28,  28,  28,  36,  36,  36,  36,  44,  44,  44,  44,  52,  52,  52,  52,  60,  60,  60,  60,  68,  68,  68,  68,  76,  76,  76,  76,  84,  84,  84,  84,  92,  92,  92,  92, 108, 108, 108, 108, 108, 108, 108, 108, 108, 108, 108,  22,  22,  22,  22,  30,  30,  30,  30,  23,  23,  23,  23,  15,  15,  15,  15},
+        /*
+         |        LCTRL        |  |         LWIN        |  |         LALT        |  |                                                          SPACE                                                          |  |         RALT        |  |         RWIN        |  |          FN         |  |        RCTRL        |  |   KP 0  LEFT   |  |      KP 00     |  |      KP .      |  |    KP ENTER    | */
+        {  5,   5,   5,   5,   5,  13,  13,  13,  13,  13,  21,  21,  21,  21,  21,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  77,  77,  77,  77,  77,  85,  85,  85,  85,  85,  93,  93,  93,  93,  93, 101, 101, 101, 101, 101,   6,   6,   6,   6,  14,  14,  14,  14,   7,   7,   7,   7,  15,  15,  15,  15},
+    };
+};
+
+// Driver for a MasterKeys board described by Layout, see ProMLayout
+template<typename Layout>
+class CMMKDevice {
+  public:
+    using layout = Layout;
+    static constexpr uint16_t usb_vendor_id = Layout::usb_vendor_id;
+    static constexpr uint16_t usb_product_id = Layout::usb_product_id;
+    static constexpr int usb_interface = Layout::usb_interface;
+    static constexpr unsigned char usb_endpoint_out = Layout::usb_endpoint_out;
+    static constexpr unsigned char usb_endpoint_in = Layout::usb_endpoint_in;
+    static constexpr unsigned int usb_timeout_ms = Layout::usb_timeout_ms;
+    static constexpr size_t packet_size = Layout::packet_size;
+    static constexpr size_t num_packets = Layout::num_packets;
+    static constexpr size_t leds_per_packet = Layout::leds_per_packet;
+    // packet masks are 32 bit
+    static_assert(num_packets <= 32);
+
+    static constexpr size_t key_map_cols = Layout::key_map_cols;
+    static constexpr size_t key_map_rows = Layout::key_map_rows;
+    using led_matrix = RGB[key_map_rows][key_map_cols];
+
+    // Result of an asynchronous frame upload, reported once every transfer of the frame has finished
+    struct FrameStatus {
+        uint64_t frame = 0;
+        // 0 on success, otherwise the libusb error of the first transfer that failed
+        int error = 0;
+        // bit i is set if packet i was sent in this frame, the others were unchanged and skipped
+        uint32_t packet_mask = 0;
+        std::chrono::steady_clock::duration elapsed{};
+        // the IN report the board sent back for each packet, only fresh for packets in packet_mask
+        uint8_t acks[num_packets][packet_size]{};
+    };
+    using FrameCallback = std::function<void(const FrameStatus &)>;
+    // mapping of matrix positions to index in data stream
+    static constexpr const ssize_t (&key_map)[key_map_rows][key_map_cols] = Layout::key_map;
+    static constexpr size_t num_keys = []() constexpr -> size_t {
         const size_t max_keys = 256;
         bool keys[max_keys]{};
         for (size_t i = 0; i < key_map_cols * key_map_rows; i++) {
             const ssize_t key = key_map[i / key_map_cols][i % key_map_cols];
             if (key < 0)
                 continue;
-            if (static_cast<size_t>(key) > max_keys)
+            if (static_cast<size_t>(key) >= max_keys)
                 throw "Key value too large, please adjust max_keys in this function";
             keys[key] = true;
         }
@@ -97,6 +256,13 @@ class CMMKProM {
         }
         return count;
     }();
+    // largest LED id on the key map, set_leds indexes the packet payloads with these ids
+    static constexpr ssize_t max_key_id = []() constexpr -> ssize_t {
+        ssize_t max_id = -1;
+        for (size_t i = 0; i < key_map_cols * key_map_rows; i++)
+            max_id = std::max(max_id, key_map[i / key_map_cols][i % key_map_cols]);
+        return max_id;
+    }();
     static constexpr auto key_ids = MakeArray<ssize_t, num_keys>(
         [](size_t size, auto arr) constexpr -> void {
             size_t j = 0;
@@ -112,32 +278,13 @@ class CMMKProM {
         }
     );
 
-    static const size_t big_key_map_rows = key_map_rows;
-    static const size_t big_key_map_cols = key_map_cols * 4;
-    // Bigger version of the above keymap that takes into account the physical positions of the keys
-    // The keys on the board come in quarter sizes (eg the CTRL keys are 1.25 units wide)
-    static constexpr ssize_t big_key_map[big_key_map_rows][big_key_map_cols] = {
-        /*
-         |       ESC      |                      |       F1       |  |       F2       |  |       F3       |  |       F4       |            |       F5       |  |       F6       |  |       F7       |  |       F8       |            |       F9       |  |       F10      |  |       F11      |  |       F12      |                                                                                 */
-        {  0,   0,   0,   0,  -1,  -1,  -1,  -1,   8,   8,   8,   8,  16,  16,  16,  16,  24,  24,  24,  24,  32,  32,  32,  32,  -1,  -1,  40,  40,  40,  40,  48,  48,  48,  48,  56,  56,  56,  56,  64,  64,  64,  64,  -1,  -1,  72,  72,  72,  72,  80,  80,  80,  80,  88,  88,  88,  88,  96,  96,  96,  96,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1},
-        /*
-         |        ~       |  |        1       |  |        2       |  |        3       |  |        4       |  |        5       |  |        6       |  |        7       |  |        8       |  |        9       |  |        0       |  |       -_       |  |       =+       |  |              BACKSPACE             |  |     NUMLOCK    |  |      KP /      |  |      KP *      |  |      KP -      | */
-        {  1,   1,   1,   1,   9,   9,   9,   9,  17,  17,  17,  17,  25,  25,  25,  25,  33,  33,  33,  33,  41,  41,  41,  41,  49,  49,  49,  49,  57,  57,  57,  57,  65,  65,  65,  65,  73,  73,  73,  73,  81,  81,  81,  81,  89,  89,  89,  89,  97,  97,  97,  97, 104, 104, 104, 104, 104, 104, 104, 104, 109, 109, 109, 109,  70,  70,  70,  70,  63,  63,  63,  63,  71,  71,  71,  71},
-        /*
-         |            TAB           |  |        Q       |  |        W       |  |        E       |  |        R       |  |        T       |  |        Y       |  |        U       |  |        I       |  |        O       |  |        P       |  |        [       |  |        ]       |  |            \|            |  |      KP 7      |  |      KP 8      |  |      KP 9      |  |      KP +      | */
-        {  2,   2,   2,   2,   2,   2,  10,  10,  10,  10,  18,  18,  18,  18,  26,  26,  26,  26,  34,  34,  34,  34,  42,  42,  42,  42,  50,  50,  50,  50,  58,  58,  58,  58,  66,  66,  66,  66,  74,  74,  74,  74,  82,  82,  82,  82,  90,  90,  90,  90,  98,  98,  98,  98, 106, 106, 106, 106, 106, 106,  54,  54,  54,  54,  62,  62,  62,  62,  55,  55,  55,  55,  47,  47,  47,  47},
-        /*
-         |            CAPSLOCK           |  |        A       |  |        S       |  |        D       |  |        F       |  |        G       |  |        H       |  |        J       |  |        K       |  |        L       |  |       ;:       |  |       '"       |  |                  ENTER                  |  |      KP 4      |  |      KP 5      |  |      KP 6      |  |      KP +      | */
-        {  3,   3,   3,   3,   3,   3,   3,  11,  11,  11,  11,  19,  19,  19,  19,  27,  27,  27,  27,  35,  35,  35,  35,  43,  43,  43,  43,  51,  51,  51,  51,  59,  59,  59,  59,  67,  67,  67,  67,  75,  75,  75,  75,  83,  83,  83,  83,  91,  91,  91,  91, 107, 107, 107, 107, 107, 107, 107, 107, 107,  38,  38,  38,  38,  46,  46,  46,  46,  31,  31,  31,  31,  47,  47,  47,  47},
-        /*
-         |                  LSHIFT                 |  |        Z       |  |        X       |  |        C       |  |        V       |  |        B       |  |        N       |  |        M       |  |       ,<       |  |       .>       |  |       /?       |  |                       RSHIFT                      |  |      KP 1      |  |      KP 2      |  |      KP 3      |  |    KP ENTER    | */
-        {  4,   4,   4,   4,   4,   4,   4,   4,   4,  20,  20,  20,  20,  28,  28,  28,  28,  36,  36,  36,  36,  44,  44,  44,  44,  52,  52,  52,  52,  60,  60,  60,  60,  68,  68,  68,  68,  76,  76,  76,  76,  84,  84,  84,  84,  92,  92,  92,  92, 108, 108, 108, 108, 108, 108, 108, 108, 108, 108, 108,  22,  22,  22,  22,  30,  30,  30,  30,  23,  23,  23,  23,  15,  15,  15,  15},
-        /*
-         |        LCTRL        |  |         LWIN        |  |         LALT        |  |                                                          SPACE                                                          |  |         RALT        |  |         RWIN        |  |          FN         |  |        RCTRL        |  |   KP 0  LEFT   |  |      KP 00     |  |      KP .      |  |    KP ENTER    | */
-        {  5,   5,   5,   5,   5,  13,  13,  13,  13,  13,  21,  21,  21,  21,  21,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  77,  77,  77,  77,  77,  85,  85,  85,  85,  85,  93,  93,  93,  93,  93, 101, 101, 101, 101, 101,   6,   6,   6,   6,  14,  14,  14,  14,   7,   7,   7,   7,  15,  15,  15,  15},
-    };
+    static constexpr size_t big_key_map_rows = Layout::big_key_map_rows;
+    static constexpr size_t big_key_map_cols = Layout::big_key_map_cols;
+    // Bigger version of key_map that takes into account the physical positions of the keys
+    static constexpr const ssize_t (&big_key_map)[big_key_map_rows][big_key_map_cols] = Layout::big_key_map;
+    static_assert(big_key_map_rows % key_map_rows == 0 && big_key_map_cols % key_map_cols == 0);
 
-    static const size_t max_key_cells = []() constexpr -> size_t {
+    static constexpr size_t max_key_cells = []() constexpr -> size_t {
         const size_t y_scale = big_key_map_rows / key_map_rows;
         const size_t x_scale = big_key_map_cols / key_map_cols;
 
@@ -201,54 +348,432 @@ class CMMKProM {
         }
     );
 
-  private:
-    libusb_context *ctx = nullptr;
-    libusb_device_handle *dev = nullptr;
+    static constexpr size_t num_leds = num_packets * leds_per_packet;
+    // resample tables store LED positions in a byte
+    static_assert(num_leds <= 256);
+    static_assert(max_key_id < (ssize_t)num_leds, "key map uses LED ids beyond the packets");
+#if defined(__AVX2__)
+    static constexpr size_t resample_lanes = 8;
+#else
+    static constexpr size_t resample_lanes = 4;
+#endif
+
+    // LEDs ordered by the number of cells their key covers (0 for LEDs without a key)
+    static constexpr auto resample_order = MakeArray<uint8_t, num_leds>(
+        [](size_t size, auto arr) constexpr -> void {
+            size_t j = 0;
+            for (size_t cells = 0; cells <= max_key_cells; cells++) {
+                for (size_t led = 0; led < size; led++) {
+                    size_t led_cells = 0;
+                    for (size_t i = 0; i < num_keys; i++) {
+                        if (key_ids.arr[i] == (ssize_t)led)
+                            led_cells = key_scales.arr[i].num_cells;
+                    }
+                    if (led_cells != cells)
+                        continue;
+                    arr[j] = led;
+                    j++;
+                }
+            }
+            if (j != size)
+                throw "Key ids do not all fit in the packets";
+        }
+    );
+
+    static constexpr size_t num_resample_entries = []() constexpr -> size_t {
+        size_t count = 0;
+        for (size_t i = 0; i < num_keys; i++) {
+            // the last LED of each group covers the most cells
+            for (size_t group = 0; group < num_leds / resample_lanes; group++) {
+                if (key_ids.arr[i] == resample_order.arr[(group + 1) * resample_lanes - 1])
+                    count += key_scales.arr[i].num_cells;
+            }
+        }
+        return count;
+    }();
+
+    static constexpr auto resample_table = []() constexpr {
+        ResampleTable<num_leds, resample_lanes, num_resample_entries> table{};
 
-    void throw_if_err(int ret, std::string msg) {
-        if (ret == 0)
+        size_t n = 0;
+        for (size_t group = 0; group < table.num_groups; group++) {
+            table.group_offsets[group] = n;
+            size_t group_cells = 0;
+            for (size_t lane = 0; lane < table.lanes; lane++) {
+                const size_t led = resample_order.arr[group * table.lanes + lane];
+                table.leds[group][lane] = led;
+                for (size_t i = 0; i < num_keys; i++) {
+                    if (key_ids.arr[i] != (ssize_t)led)
+                        continue;
+
+                    // keep the cell order of key_scales so sums round the same way
+                    const auto &key_scale = key_scales.arr[i];
+                    for (size_t j = 0; j < key_scale.num_cells; j++) {
+                        const auto &cell = key_scale.cell_scales[j];
+                        table.cells[n + j][lane] = (cell.y * key_map_cols + cell.x) * sizeof(RGB);
+                        table.weights[n + j][lane] = cell.scale;
+                    }
+                    group_cells = std::max(group_cells, key_scale.num_cells);
+                }
+            }
+            n += group_cells;
+        }
+        table.group_offsets[table.num_groups] = n;
+        return table;
+    }();
+
+    // Resamples the matrix onto the keys, writing num_leds values in packet order.
+    // With use_rgb off only the red channel is computed and green/blue are zeroed.
+    // The result is bit for bit what summing key_scales in order and truncating gives.
+    static void resample(const led_matrix matrix, RGB *linear_data, bool use_rgb) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&matrix[0][0]);
+        if (!use_rgb) {
+            resample_groups<false>(resample_table, bytes, linear_data);
+            return;
+        }
+
+        // copy into a padded buffer so every cell can be loaded as one 4 byte word
+        uint8_t padded[sizeof(led_matrix) + 1];
+        std::memcpy(padded, bytes, sizeof(led_matrix));
+        padded[sizeof(led_matrix)] = 0;
+        resample_groups<true>(resample_table, padded, linear_data);
+    }
+
+    static constexpr auto fixed_resample_table = quantise(resample_table);
+
+    // resample in integer arithmetic with fixed_resample_table, for hosts where float
+    // conversions are slow. Results are within one step of resample.
+    static void resample_fixed(const led_matrix matrix, RGB *linear_data, bool use_rgb) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&matrix[0][0]);
+        if (!use_rgb) {
+            resample_groups_fixed<false>(fixed_resample_table, bytes, linear_data);
             return;
-        msg += "; ret = " + std::to_string(ret);
-        throw std::runtime_error(msg.c_str());
-    }
-
-    std::pair<int, int> send_command(
-        uint8_t *data,
-        uint8_t *recv_data,
-        size_t size
-    ) {
-        std::pair<int, int> actual;
-
-        throw_if_err(
-            libusb_interrupt_transfer(
-                dev,
-                usb_endpoint_out,
-                data,
-                size,
-                &actual.first,
-                100
-            ),
-            "Failed to send data"
-        );
-
-        throw_if_err(
-            libusb_interrupt_transfer(
-                dev,
-                usb_endpoint_in,
-                data,
-                size,
-                &actual.second,
-                100
-            ),
-            "Failed to receive data"
-        );
-
-        return actual;
-    }
-
-    int recv_data(uint8_t *data, size_t data_size) {
-        int actual;
-        return actual;
+        }
+
+        uint8_t padded[sizeof(led_matrix) + 1];
+        std::memcpy(padded, bytes, sizeof(led_matrix));
+        padded[sizeof(led_matrix)] = 0;
+        resample_groups_fixed<true>(fixed_resample_table, padded, linear_data);
+    }
+
+    // Weight of each bar on an LED, given the bar every matrix cell shows (negative for unlit cells)
+    template<size_t NumBars, const ssize_t (&BarMap)[key_map_rows][key_map_cols]>
+    static constexpr void led_bar_weights(size_t led, float (&weights)[NumBars]) {
+        for (size_t i = 0; i < num_keys; i++) {
+            if (key_ids.arr[i] != (ssize_t)led)
+                continue;
+            const auto &key_scale = key_scales.arr[i];
+            for (size_t j = 0; j < key_scale.num_cells; j++) {
+                const auto &cell = key_scale.cell_scales[j];
+                const ssize_t bar = BarMap[cell.y][cell.x];
+                if (bar < 0)
+                    continue;
+                if ((size_t)bar >= NumBars)
+                    throw "Bar index out of range";
+                weights[bar] += cell.scale;
+            }
+        }
+    }
+
+    template<size_t NumBars, const ssize_t (&BarMap)[key_map_rows][key_map_cols]>
+    static constexpr size_t num_led_bars(size_t led) {
+        float weights[NumBars]{};
+        led_bar_weights<NumBars, BarMap>(led, weights);
+        size_t count = 0;
+        for (size_t bar = 0; bar < NumBars; bar++) {
+            if (weights[bar] > 0)
+                count++;
+        }
+        return count;
+    }
+
+    // LEDs ordered by the number of bars lighting them
+    template<size_t NumBars, const ssize_t (&BarMap)[key_map_rows][key_map_cols]>
+    static constexpr auto bar_order() {
+        MakeArray<uint8_t, num_leds> order([](size_t size, auto arr) constexpr -> void {
+            size_t j = 0;
+            for (size_t bars = 0; bars <= NumBars && j < size; bars++) {
+                for (size_t led = 0; led < size; led++) {
+                    if (num_led_bars<NumBars, BarMap>(led) != bars)
+                        continue;
+                    arr[j] = led;
+                    j++;
+                }
+            }
+        });
+        return order;
+    }
+
+    template<size_t NumBars, const ssize_t (&BarMap)[key_map_rows][key_map_cols]>
+    static constexpr size_t num_bar_entries() {
+        constexpr auto order = bar_order<NumBars, BarMap>();
+        size_t count = 0;
+        for (size_t group = 0; group < num_leds / resample_lanes; group++)
+            count += num_led_bars<NumBars, BarMap>(order.arr[(group + 1) * resample_lanes - 1]);
+        return count;
+    }
+
+    // Composes a bar per matrix cell mapping with key_scales into a resample table over
+    // the bar values, so bars can be rendered straight onto the LEDs without filling a
+    // matrix first. Each cell offset is a bar index.
+    template<size_t NumBars, const ssize_t (&BarMap)[key_map_rows][key_map_cols]>
+    static constexpr auto make_bar_table() {
+        constexpr auto order = bar_order<NumBars, BarMap>();
+        ResampleTable<num_leds, resample_lanes, num_bar_entries<NumBars, BarMap>()> table{};
+
+        size_t n = 0;
+        for (size_t group = 0; group < table.num_groups; group++) {
+            table.group_offsets[group] = n;
+            size_t group_bars = 0;
+            for (size_t lane = 0; lane < table.lanes; lane++) {
+                const size_t led = order.arr[group * table.lanes + lane];
+                table.leds[group][lane] = led;
+
+                float weights[NumBars]{};
+                led_bar_weights<NumBars, BarMap>(led, weights);
+                size_t j = 0;
+                for (size_t bar = 0; bar < NumBars; bar++) {
+                    if (!(weights[bar] > 0))
+                        continue;
+                    table.cells[n + j][lane] = bar;
+                    table.weights[n + j][lane] = weights[bar];
+                    j++;
+                }
+                group_bars = std::max(group_bars, j);
+            }
+            n += group_bars;
+        }
+        table.group_offsets[table.num_groups] = n;
+        return table;
+    }
+
+    // Renders bar values onto the red channel of the LEDs through a table from make_bar_table
+    template<typename Table>
+    static void render_bars(const uint8_t *bars, const Table &table, RGB *linear_data) {
+        resample_groups<false>(table, bars, linear_data);
+    }
+
+    template<size_t NumLeds, size_t Lanes, size_t NumEntries>
+    static void render_bars(const uint8_t *bars, const FixedResampleTable<NumLeds, Lanes, NumEntries> &table, RGB *linear_data) {
+        resample_groups_fixed<false>(table, bars, linear_data);
+    }
+
+  private:
+    // Cells are read as 0x??BBGGRR words with UseRgb, otherwise as single red bytes
+    template<bool UseRgb, typename Table>
+    STRICT_FLOAT static void resample_groups(const Table &t, const uint8_t *cells, RGB *linear_data) {
+        STRICT_FLOAT_BODY
+
+        auto load = [cells](uint16_t offset) -> int32_t {
+            if constexpr (!UseRgb)
+                return cells[offset];
+            int32_t word;
+            std::memcpy(&word, cells + offset, sizeof(word));
+            return word;
+        };
+        auto store = [linear_data](size_t led, int32_t word) {
+            std::memcpy(&linear_data[led], &word, sizeof(RGB));
+        };
+#if defined(__SSE2__)
+        // lanes hold 0x00BBGGRR, stored straight from the register
+        auto store_lanes = [&store](const uint8_t *leds, __m128i packed) {
+            for (size_t lane = 0; lane < 4; lane++) {
+                store(leds[lane], _mm_cvtsi128_si32(packed));
+                packed = _mm_srli_si128(packed, 4);
+            }
+        };
+#endif
+
+        for (size_t group = 0; group < t.num_groups; group++) {
+            const size_t begin = t.group_offsets[group];
+            const size_t end = t.group_offsets[group + 1];
+            const uint8_t *leds = t.leds[group];
+
+#if defined(__AVX2__)
+            const __m256i byte_mask = _mm256_set1_epi32(0xff);
+            __m256 r = _mm256_setzero_ps(), g = r, b = r;
+            for (size_t e = begin; e < end; e++) {
+                const uint16_t *offsets = t.cells[e];
+                const __m256i words = _mm256_setr_epi32(
+                    load(offsets[0]), load(offsets[1]), load(offsets[2]), load(offsets[3]),
+                    load(offsets[4]), load(offsets[5]), load(offsets[6]), load(offsets[7])
+                );
+                const __m256 w = _mm256_loadu_ps(t.weights[e]);
+                r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(words, byte_mask)), w));
+                if (UseRgb) {
+                    g = _mm256_add_ps(g, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(words, 8), byte_mask)), w));
+                    b = _mm256_add_ps(b, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(words, 16), byte_mask)), w));
+                }
+            }
+
+            const __m256 zero = _mm256_setzero_ps(), max = _mm256_set1_ps(255.0f);
+            auto to_bytes = [&](__m256 v) {
+                return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(v, zero), max));
+            };
+            __m256i packed = to_bytes(r);
+            if (UseRgb) {
+                packed = _mm256_or_si256(packed, _mm256_slli_epi32(to_bytes(g), 8));
+                packed = _mm256_or_si256(packed, _mm256_slli_epi32(to_bytes(b), 16));
+            }
+            store_lanes(leds, _mm256_castsi256_si128(packed));
+            store_lanes(leds + 4, _mm256_extracti128_si256(packed, 1));
+#elif defined(__SSE2__)
+            const __m128i byte_mask = _mm_set1_epi32(0xff);
+            __m128 r = _mm_setzero_ps(), g = r, b = r;
+            for (size_t e = begin; e < end; e++) {
+                const uint16_t *offsets = t.cells[e];
+                const __m128i words = _mm_setr_epi32(load(offsets[0]), load(offsets[1]), load(offsets[2]), load(offsets[3]));
+                const __m128 w = _mm_loadu_ps(t.weights[e]);
+                r = _mm_add_ps(r, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(words, byte_mask)), w));
+                if (UseRgb) {
+                    g = _mm_add_ps(g, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(words, 8), byte_mask)), w));
+                    b = _mm_add_ps(b, _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(words, 16), byte_mask)), w));
+                }
+            }
+
+            const __m128 zero = _mm_setzero_ps(), max = _mm_set1_ps(255.0f);
+            auto to_bytes = [&](__m128 v) {
+                return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(v, zero), max));
+            };
+            __m128i packed = to_bytes(r);
+            if (UseRgb) {
+                packed = _mm_or_si128(packed, _mm_slli_epi32(to_bytes(g), 8));
+                packed = _mm_or_si128(packed, _mm_slli_epi32(to_bytes(b), 16));
+            }
+            store_lanes(leds, packed);
+#else
+            const size_t lanes = Table::lanes;
+            float r[lanes]{}, g[lanes]{}, b[lanes]{};
+            for (size_t e = begin; e < end; e++) {
+                for (size_t lane = 0; lane < lanes; lane++) {
+                    const int32_t word = load(t.cells[e][lane]);
+                    const float w = t.weights[e][lane];
+                    r[lane] += (float)(word & 0xff) * w;
+                    if (UseRgb) {
+                        g[lane] += (float)((word >> 8) & 0xff) * w;
+                        b[lane] += (float)((word >> 16) & 0xff) * w;
+                    }
+                }
+            }
+            for (size_t lane = 0; lane < lanes; lane++) {
+                store(leds[lane], (int32_t)std::clamp(r[lane], 0.0f, 255.0f)
+                    | (int32_t)std::clamp(g[lane], 0.0f, 255.0f) << 8
+                    | (int32_t)std::clamp(b[lane], 0.0f, 255.0f) << 16);
+            }
+#endif
+        }
+    }
+
+    // resample_groups in integers for a FixedResampleTable, sums are truncated and saturate at 255
+    template<bool UseRgb, typename Table>
+    static void resample_groups_fixed(const Table &t, const uint8_t *cells, RGB *linear_data) {
+        constexpr int shift = Table::weight_bits;
+
+        auto load = [cells](uint16_t offset) -> int32_t {
+            if constexpr (!UseRgb)
+                return cells[offset];
+            int32_t word;
+            std::memcpy(&word, cells + offset, sizeof(word));
+            return word;
+        };
+        auto store = [linear_data](size_t led, int32_t word) {
+            std::memcpy(&linear_data[led], &word, sizeof(RGB));
+        };
+#if defined(__SSE2__)
+        auto store_lanes = [&store](const uint8_t *leds, __m128i packed) {
+            for (size_t lane = 0; lane < 4; lane++) {
+                store(leds[lane], _mm_cvtsi128_si32(packed));
+                packed = _mm_srli_si128(packed, 4);
+            }
+        };
+#endif
+
+        for (size_t group = 0; group < t.num_groups; group++) {
+            const size_t begin = t.group_offsets[group];
+            const size_t end = t.group_offsets[group + 1];
+            const uint8_t *leds = t.leds[group];
+
+#if defined(__AVX2__)
+            // channels and weights both sit in the low half of each 32 bit lane, so madd_epi16 is a plain multiply
+            const __m256i byte_mask = _mm256_set1_epi32(0xff);
+            __m256i r = _mm256_setzero_si256(), g = r, b = r;
+            for (size_t e = begin; e < end; e++) {
+                const uint16_t *offsets = t.cells[e];
+                const __m256i words = _mm256_setr_epi32(
+                    load(offsets[0]), load(offsets[1]), load(offsets[2]), load(offsets[3]),
+                    load(offsets[4]), load(offsets[5]), load(offsets[6]), load(offsets[7])
+                );
+                const __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(t.weights[e])));
+                r = _mm256_add_epi32(r, _mm256_madd_epi16(_mm256_and_si256(words, byte_mask), w));
+                if (UseRgb) {
+                    g = _mm256_add_epi32(g, _mm256_madd_epi16(_mm256_and_si256(_mm256_srli_epi32(words, 8), byte_mask), w));
+                    b = _mm256_add_epi32(b, _mm256_madd_epi16(_mm256_and_si256(_mm256_srli_epi32(words, 16), byte_mask), w));
+                }
+            }
+
+            auto to_bytes = [&](__m256i v) {
+                return _mm256_min_epi32(_mm256_srli_epi32(v, shift), byte_mask);
+            };
+            __m256i packed = to_bytes(r);
+            if (UseRgb) {
+                packed = _mm256_or_si256(packed, _mm256_slli_epi32(to_bytes(g), 8));
+                packed = _mm256_or_si256(packed, _mm256_slli_epi32(to_bytes(b), 16));
+            }
+            store_lanes(leds, _mm256_castsi256_si128(packed));
+            store_lanes(leds + 4, _mm256_extracti128_si256(packed, 1));
+#elif defined(__SSE2__)
+            const __m128i byte_mask = _mm_set1_epi32(0xff);
+            const __m128i zero = _mm_setzero_si128();
+            __m128i r = zero, g = r, b = r;
+            for (size_t e = begin; e < end; e++) {
+                const uint16_t *offsets = t.cells[e];
+                const __m128i words = _mm_setr_epi32(load(offsets[0]), load(offsets[1]), load(offsets[2]), load(offsets[3]));
+                const __m128i w = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(t.weights[e])), zero);
+                r = _mm_add_epi32(r, _mm_madd_epi16(_mm_and_si128(words, byte_mask), w));
+                if (UseRgb) {
+                    g = _mm_add_epi32(g, _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(words, 8), byte_mask), w));
+                    b = _mm_add_epi32(b, _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(words, 16), byte_mask), w));
+                }
+            }
+
+            // SSE2 has no 32 bit min, lanes over 255 are set to all ones before masking instead
+            auto to_bytes = [&](__m128i v) {
+                v = _mm_srli_epi32(v, shift);
+                return _mm_and_si128(_mm_or_si128(v, _mm_cmpgt_epi32(v, byte_mask)), byte_mask);
+            };
+            __m128i packed = to_bytes(r);
+            if (UseRgb) {
+                packed = _mm_or_si128(packed, _mm_slli_epi32(to_bytes(g), 8));
+                packed = _mm_or_si128(packed, _mm_slli_epi32(to_bytes(b), 16));
+            }
+            store_lanes(leds, packed);
+#else
+            const size_t lanes = Table::lanes;
+            uint32_t r[lanes]{}, g[lanes]{}, b[lanes]{};
+            for (size_t e = begin; e < end; e++) {
+                for (size_t lane = 0; lane < lanes; lane++) {
+                    const int32_t word = load(t.cells[e][lane]);
+                    const uint32_t w = (uint16_t)t.weights[e][lane];
+                    r[lane] += (uint32_t)(word & 0xff) * w;
+                    if (UseRgb) {
+                        g[lane] += (uint32_t)((word >> 8) & 0xff) * w;
+                        b[lane] += (uint32_t)((word >> 16) & 0xff) * w;
+                    }
+                }
+            }
+            for (size_t lane = 0; lane < lanes; lane++) {
+                store(leds[lane], (int32_t)std::min<uint32_t>(r[lane] >> shift, 255)
+                    | (int32_t)std::min<uint32_t>(g[lane] >> shift, 255) << 8
+                    | (int32_t)std::min<uint32_t>(b[lane] >> shift, 255) << 16);
+            }
+#endif
+        }
+    }
+
+    std::unique_ptr<Transport> transport;
+
+    void send_command(uint8_t *data, uint8_t *recv_data, size_t size) {
+        transport->send_command(data, recv_data, size);
     }
 
     struct SetLedsData {
@@ -256,56 +781,261 @@ class CMMKProM {
         uint8_t v2 = 0x02;
         uint8_t v3 = 0xFF;
         uint8_t v4 = 0x00;
-        RGB leds[16]{};
-        uint8_t padding[12]{};
+        RGB leds[leds_per_packet]{};
+        uint8_t padding[packet_size - 4 - leds_per_packet * sizeof(RGB)]{};
 
-        SetLedsData(uint8_t index) {
+        SetLedsData(uint8_t index = 0) {
             v3 = index * 2;
         }
     };
-    static_assert(sizeof(SetLedsData) == 64);
+    static_assert(sizeof(SetLedsData) == packet_size);
 
+    // Packet buffers are members so that they outlive the transfers submitted in async mode
+    SetLedsData out_packets[num_packets];
+    uint8_t ack_packets[num_packets][packet_size]{};
 
-  public:
-    CMMKProM() {
-        throw_if_err(
-            libusb_init(&ctx),
-            "Failed to init libusb"
-        );
-
-        dev = libusb_open_device_with_vid_pid(ctx, 0x2516, 0x0048);
-        if (!dev)
-            throw std::runtime_error("Failed to open device");
-
-        if (libusb_kernel_driver_active(dev, usb_interface)) {
-            throw_if_err(
-                libusb_detach_kernel_driver(dev,  usb_interface),
-                "Failed to detach kernel driver"
+    // delta encoding state: what the board is known to display, per packet
+    RGB acked_leds[num_packets][leds_per_packet]{};
+    bool acked_valid[num_packets]{};
+    uint8_t delta_threshold = 0;
+    size_t full_refresh_interval = 50;
+    bool refresh_next = false;
+    size_t frames_since_refresh = 0;
+
+    // async upload state
+    bool async = false;
+    Transport::Exchange exchanges[num_packets];
+    std::mutex frame_mutex;
+    std::condition_variable frame_cv;
+    bool frame_pending = false;
+    FrameStatus frame_status;
+    std::chrono::steady_clock::time_point frame_start;
+    FrameCallback on_frame;
+
+    void transport_done(int error) {
+        std::unique_lock lock(frame_mutex);
+        frame_status.error = error;
+        finish_frame(lock);
+    }
+
+    // Called with frame_mutex held once the last transfer of a frame is done
+    void finish_frame(std::unique_lock<std::mutex> &lock) {
+        frame_status.elapsed = std::chrono::steady_clock::now() - frame_start;
+        if (Profiler::instance().enabled())
+            Profiler::instance().record(Stage::UsbFrame, frame_status.elapsed);
+        for (size_t i = 0; i < num_packets; i++) {
+            if (frame_status.packet_mask & (1u << i))
+                mark_acked(i, frame_status.error == 0);
+        }
+        std::copy(&ack_packets[0][0], &ack_packets[0][0] + sizeof(ack_packets), &frame_status.acks[0][0]);
+        frame_pending = false;
+        const FrameStatus status = frame_status;
+        lock.unlock();
+        frame_cv.notify_all();
+        if (on_frame)
+            on_frame(status);
+    }
+
+    void submit_frame(uint32_t packet_mask) {
+        size_t count = 0;
+        for (size_t i = 0; i < num_packets; i++) {
+            if (!(packet_mask & (1u << i)))
+                continue;
+            exchanges[count].out = reinterpret_cast<const uint8_t *>(&out_packets[i]);
+            exchanges[count].in = ack_packets[i];
+            count++;
+        }
+
+        {
+            std::unique_lock lock(frame_mutex);
+            frame_status.frame++;
+            frame_status.error = 0;
+            frame_status.packet_mask = packet_mask;
+            frame_start = std::chrono::steady_clock::now();
+            frame_pending = true;
+            if (count == 0) {
+                finish_frame(lock);
+                return;
+            }
+        }
+
+        // the completion may run before submit returns, so the lock must not be held here
+        transport->submit(exchanges, count);
+    }
+
+    void mark_acked(size_t packet, bool ok) {
+        acked_valid[packet] = ok;
+        if (ok)
+            std::copy(out_packets[packet].leds, out_packets[packet].leds + leds_per_packet, acked_leds[packet]);
+    }
+
+    bool packet_changed(size_t packet, const RGB *leds) const {
+        if (!acked_valid[packet])
+            return true;
+
+        auto differs = [this](uint8_t a, uint8_t b) {
+            return std::abs((int)a - (int)b) > (int)delta_threshold;
+        };
+        for (size_t j = 0; j < leds_per_packet; j++) {
+            const RGB &old = acked_leds[packet][j];
+            if (differs(old.r, leds[j].r) || differs(old.g, leds[j].g) || differs(old.b, leds[j].b))
+                return true;
+        }
+        return false;
+    }
+
+    void upload(const RGB *linear_data) {
+        // the packet buffers belong to the frame in flight until it completes
+        if (async)
+            wait_frame();
+
+        // periodically resend everything in case the board silently dropped a packet
+        bool refresh = refresh_next;
+        refresh_next = false;
+        if (full_refresh_interval > 0 && ++frames_since_refresh >= full_refresh_interval) {
+            refresh = true;
+            frames_since_refresh = 0;
+        }
+
+        uint32_t packet_mask = 0;
+        for (size_t i = 0; i < num_packets; i++) {
+            const RGB *leds = linear_data + i * leds_per_packet;
+            if (!refresh && !packet_changed(i, leds))
+                continue;
+            std::copy(leds, leds + leds_per_packet, out_packets[i].leds);
+            packet_mask |= 1u << i;
+        }
+
+        if (async) {
+            submit_frame(packet_mask);
+            return;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_packets; i++) {
+            if (!(packet_mask & (1u << i)))
+                continue;
+            acked_valid[i] = false;
+            send_command(
+                reinterpret_cast<uint8_t *>(&out_packets[i]),
+                ack_packets[i],
+                sizeof(SetLedsData)
             );
+            mark_acked(i, true);
         }
 
-        throw_if_err(
-            libusb_claim_interface(dev, usb_interface),
-            "Failed to claim interface"
-        );
+        std::lock_guard lock(frame_mutex);
+        frame_status.frame++;
+        frame_status.error = 0;
+        frame_status.packet_mask = packet_mask;
+        frame_status.elapsed = std::chrono::steady_clock::now() - start;
+        std::copy(&ack_packets[0][0], &ack_packets[0][0] + sizeof(ack_packets), &frame_status.acks[0][0]);
+    }
+
+  public:
+    // Opens the first board of this model found on USB
+    CMMKDevice() : CMMKDevice(std::make_unique<UsbTransport>(
+        usb_vendor_id, usb_product_id, usb_interface, usb_endpoint_out, usb_endpoint_in, usb_timeout_ms
+    )) {}
+
+    // Opens the board with the given USB port path (eg "1-2.3") or serial number
+    explicit CMMKDevice(const std::string &device) : CMMKDevice(std::make_unique<UsbTransport>(
+        usb_vendor_id, usb_product_id, usb_interface, usb_endpoint_out, usb_endpoint_in, usb_timeout_ms, device
+    )) {}
+
+    static std::vector<UsbTransport::DeviceInfo> list_devices() {
+        return UsbTransport::enumerate(usb_vendor_id, usb_product_id);
+    }
+
+    // Rate controller settings for this board's frame size
+    static FrameRateController::Options rate_options() {
+        FrameRateController::Options options;
+        options.frame_packets = num_packets;
+        return options;
+    }
+
+    explicit CMMKDevice(std::unique_ptr<Transport> transport) : transport(std::move(transport)) {
+        for (size_t i = 0; i < num_packets; i++)
+            out_packets[i] = SetLedsData(i);
 
         enable_led_control();
     }
 
-    ~CMMKProM() {
-        libusb_release_interface(dev, usb_interface);
-        libusb_attach_kernel_driver(dev, usb_interface);
-        libusb_close(dev);
-        libusb_exit(ctx);
+    ~CMMKDevice() {
+        stop_async();
     }
 
     void enable_led_control() {
-        uint8_t data[64] = {0x41, 2};
+        uint8_t data[packet_size] = {0x41, 2};
         send_command(data, data, sizeof(data));
+        invalidate_leds();
     }
 
-    void set_leds(led_matrix matrix) {
-        RGB linear_data[256]{};
+    // Forgets what the board is displaying so the next frame is sent in full
+    void invalidate_leds() {
+        std::fill(acked_valid, acked_valid + num_packets, false);
+    }
+
+    // Packets whose LEDs all stay within this many levels of what was last acknowledged are not resent
+    void set_delta_threshold(uint8_t threshold) {
+        delta_threshold = threshold;
+    }
+
+    // Every this many frames all packets are sent regardless of changes, 0 disables the refresh
+    void set_full_refresh_interval(size_t frames) {
+        full_refresh_interval = frames;
+    }
+
+    // Sends every packet of the next frame even if unchanged, e.g. as a keep-alive
+    void refresh_next_frame() {
+        refresh_next = true;
+    }
+
+    // Switches frame uploads to pipelined async transfers.
+    // set_leds* then return as soon as the frame is queued; on_frame_done is called
+    // (from the transport's thread) when the whole frame has been acknowledged.
+    void start_async(FrameCallback on_frame_done = nullptr) {
+        if (async)
+            return;
+
+        on_frame = std::move(on_frame_done);
+        transport->start_async(num_packets, packet_size, [this](int error) { transport_done(error); });
+        async = true;
+    }
+
+    void stop_async() {
+        if (!async)
+            return;
+
+        wait_frame(std::chrono::seconds(1));
+        transport->stop_async();
+        async = false;
+        on_frame = nullptr;
+    }
+
+    bool is_async() const {
+        return async;
+    }
+
+    // Blocks until the frame in flight (if any) has completed, returns false on timeout
+    bool wait_frame(std::chrono::milliseconds timeout = std::chrono::milliseconds::max()) {
+        std::unique_lock lock(frame_mutex);
+        auto done = [this] { return !frame_pending; };
+        if (timeout == std::chrono::milliseconds::max()) {
+            frame_cv.wait(lock, done);
+            return true;
+        }
+        return frame_cv.wait_for(lock, timeout, done);
+    }
+
+    // Status of the most recently completed frame
+    FrameStatus last_frame() {
+        std::lock_guard lock(frame_mutex);
+        return frame_status;
+    }
+
+    void set_leds(const led_matrix matrix) {
+        RGB linear_data[num_leds]{};
 
         for (size_t y = 0; y < key_map_rows; y++) {
             for (size_t x = 0; x < key_map_cols; x++) {
@@ -316,70 +1046,42 @@ class CMMKProM {
             }
         }
 
-        size_t lin_i = 0;
-        for (size_t i = 0; i < 7; i++) {
-            uint8_t recv_data[64];
-            SetLedsData data(i);
-
-            for (size_t j = 0; j < 16; j++) {
-                data.leds[j] = linear_data[lin_i];
-                lin_i++;
-            }
+        upload(linear_data);
+    }
 
-            send_command(
-                reinterpret_cast<uint8_t *>(&data),
-                recv_data,
-                sizeof(SetLedsData)
-            );
+    void set_leds_smooth(const led_matrix matrix, bool use_rgb = false) {
+        RGB linear_data[num_leds];
+        {
+            StageTimer timer(Stage::Render);
+            resample(matrix, linear_data, use_rgb);
         }
+        StageTimer timer(Stage::Upload);
+        upload(linear_data);
     }
 
-    void set_leds_smooth(led_matrix matrix, bool use_rgb = false) {
-        RGB linear_data[256]{};
-
-        for (size_t i = 0; i < key_scales.size; i++) {
-            const auto& key_scale = key_scales.arr[i];
-            const auto key = key_ids.arr[i];
-
-            float r = 0, g = 0, b = 0;
-            for (size_t j = 0; j < key_scale.num_cells; j++) {
-                const auto& cell = key_scale.cell_scales[j];
-                const auto& rgb = matrix[cell.y][cell.x];
-                r += (float)rgb.r * cell.scale;
-                if (use_rgb) {
-                    g += (float)rgb.g * cell.scale;
-                    b += (float)rgb.b * cell.scale;
-                }
-            }
-            r = std::clamp(r, 0.0f, 255.0f);
-            if (use_rgb) {
-                g = std::clamp(g, 0.0f, 255.0f);
-                b = std::clamp(b, 0.0f, 255.0f);
-            }
-            linear_data[key] = {(uint8_t)r, (uint8_t)g, (uint8_t)b};
+    // Same as set_leds_smooth on the matrix the bars would fill, without building the matrix
+    template<typename Table>
+    void set_leds_from_bars(const uint8_t *bars, const Table &table) {
+        RGB linear_data[num_leds];
+        {
+            StageTimer timer(Stage::Render);
+            render_bars(bars, table, linear_data);
         }
+        StageTimer timer(Stage::Upload);
+        upload(linear_data);
+    }
 
-        size_t lin_i = 0;
-        for (size_t i = 0; i < 7; i++) {
-            uint8_t recv_data[64];
-            SetLedsData data(i);
-
-            for (size_t j = 0; j < 16; j++) {
-                data.leds[j] = linear_data[lin_i];
-                lin_i++;
-            }
-
-            send_command(
-                reinterpret_cast<uint8_t *>(&data),
-                recv_data,
-                sizeof(SetLedsData)
-            );
-        }
+    // Uploads num_leds values already in packet order, as rendered by resample or render_bars
+    void set_leds_linear(const RGB *linear_data) {
+        StageTimer timer(Stage::Upload);
+        upload(linear_data);
     }
 
     void do_thing() {
         using clock = std::chrono::steady_clock;
         auto start = clock::now();
+        FrameScheduler scheduler(50);
+        FrameRateController rate(rate_options());
         while (1) {
             std::chrono::duration<double> elapsed = clock::now() - start;
             double elapsed_sec = elapsed.count() * 2.0;
@@ -395,7 +1097,15 @@ class CMMKProM {
                 }
             }
             set_leds_smooth(matrix);
-            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+            // run as fast as the board acknowledges the uploads, starting from 50 fps while
+            // the controller takes its first measurements
+            const FrameStatus status = last_frame();
+            rate.on_frame(status.elapsed, std::bitset<32>(status.packet_mask).count(), status.error);
+            scheduler.retune(rate.fps());
+            scheduler.wait();
         }
     }
-};
\ No newline at end of file
+};
+
+using CMMKProM = CMMKDevice<ProMLayout>;
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+
+// Per-stage latency instrumentation for the frame pipeline.
+// Every thread records into its own preallocated counters (one writer each, so no
+// locked instructions), an optional exporter thread periodically writes what was
+// recorded since the previous export as JSON lines. While disabled a StageTimer
+// costs one relaxed atomic load.
+// A thread claims its counters with its first sample and hands them back when it
+// exits; the next export writes out what they still hold and frees them for reuse.
+
+enum class Stage : uint8_t {
+    AudioUpdate,
+    AudioGet,
+    SpectrumUpdate,
+    SpectrumGet,
+    BarMapping,
+    Render,
+    Upload,
+    UsbFrame,
+    Count
+};
+
+static inline const char *stage_name(Stage stage) {
+    static const char *names[] = {
+        "audio_update",
+        "audio_get",
+        "spectrum_update",
+        "spectrum_get",
+        "bar_mapping",
+        "render",
+        "upload",
+        "usb_frame",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == (size_t)Stage::Count);
+    return names[(size_t)stage];
+}
+
+class Profiler {
+  public:
+    static const size_t max_threads = 16;
+    static const size_t num_stages = (size_t)Stage::Count;
+    // bucket 0 counts durations under 1us, bucket i durations in [2^(i-1), 2^i) us,
+    // the last bucket everything longer
+    static const size_t num_buckets = 24;
+
+    static Profiler &instance() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    bool enabled() const {
+        return is_enabled.load(std::memory_order_relaxed);
+    }
+
+    void set_enabled(bool enable) {
+        is_enabled.store(enable, std::memory_order_relaxed);
+    }
+
+    // Names the calling thread in the exported stats, call before it records anything
+    static void name_thread(const char *name) {
+        ThreadSlot &slot = thread_slot();
+        std::strncpy(slot.name, name, sizeof(slot.name) - 1);
+    }
+
+    void record(Stage stage, std::chrono::steady_clock::duration elapsed) {
+        ThreadSlot &slot = thread_slot();
+        if (!slot.counters)
+            slot.counters = claim_thread(slot.name);
+        ThreadCounters *counters = slot.counters;
+        if (!counters)
+            return;
+
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        StageCounters &c = counters->stages[(size_t)stage];
+        add(c.count, 1);
+        add(c.total_ns, ns);
+        add(c.buckets[bucket(ns)], 1);
+        if (ns > c.max_ns.load(std::memory_order_relaxed))
+            c.max_ns.store(ns, std::memory_order_relaxed);
+    }
+
+    // Writes one JSON object per thread and stage for everything recorded since the last call
+    void write_json(std::ostream &os) {
+        std::lock_guard lock(export_mutex);
+        const uint64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()
+        ).count();
+
+        for (size_t t = 0; t < max_threads; t++) {
+            ThreadCounters &counters = threads[t];
+            const int state = counters.state.load(std::memory_order_acquire);
+            if (state != ThreadCounters::live && state != ThreadCounters::retired)
+                continue;
+
+            for (size_t s = 0; s < num_stages; s++) {
+                StageCounters &c = counters.stages[s];
+                StageSnapshot &prev = snapshots[t][s];
+
+                StageSnapshot cur;
+                cur.count = c.count.load(std::memory_order_relaxed);
+                cur.total_ns = c.total_ns.load(std::memory_order_relaxed);
+                for (size_t b = 0; b < num_buckets; b++)
+                    cur.buckets[b] = c.buckets[b].load(std::memory_order_relaxed);
+                const uint64_t max_ns = c.max_ns.exchange(0, std::memory_order_relaxed);
+
+                const uint64_t count = cur.count - prev.count;
+                if (count == 0) {
+                    prev = cur;
+                    continue;
+                }
+
+                uint64_t buckets[num_buckets];
+                for (size_t b = 0; b < num_buckets; b++)
+                    buckets[b] = cur.buckets[b] - prev.buckets[b];
+
+                os << "{\"time_ms\": " << now_ms << ", \"thread\": ";
+                write_string(os, counters.name);
+                os << ", \"stage\": \"" << stage_name((Stage)s)
+                   << "\", \"count\": " << count
+                   << ", \"mean_us\": " << (double)(cur.total_ns - prev.total_ns) / (double)count / 1000.0
+                   << ", \"max_us\": " << (double)max_ns / 1000.0
+                   << ", \"p50_us\": " << percentile(buckets, count, 0.5)
+                   << ", \"p99_us\": " << percentile(buckets, count, 0.99)
+                   << ", \"buckets\": [";
+                for (size_t b = 0; b < num_buckets; b++)
+                    os << (b ? ", " : "") << buckets[b];
+                os << "]}\n";
+                prev = cur;
+            }
+
+            // the thread has exited and its last samples are written out, free the slot
+            if (state == ThreadCounters::retired) {
+                counters.reset();
+                for (size_t s = 0; s < num_stages; s++)
+                    snapshots[t][s] = StageSnapshot{};
+                counters.state.store(ThreadCounters::free, std::memory_order_release);
+            }
+        }
+        os.flush();
+    }
+
+    // Enables recording and appends the stats to path every interval until stop_export()
+    void start_export(const std::string &path, std::chrono::milliseconds interval) {
+        stop_export();
+        export_file.open(path, std::ios::app);
+        if (!export_file)
+            throw std::runtime_error("Failed to open stats file " + path);
+
+        set_enabled(true);
+        exporting = true;
+        export_thread = std::thread([this, interval]() {
+            std::unique_lock lock(export_wait_mutex);
+            while (!export_cv.wait_for(lock, interval, [this] { return !exporting; }))
+                write_json(export_file);
+            write_json(export_file);
+        });
+    }
+
+    void stop_export() {
+        if (!export_thread.joinable())
+            return;
+        {
+            std::lock_guard lock(export_wait_mutex);
+            exporting = false;
+        }
+        export_cv.notify_all();
+        export_thread.join();
+        export_file.close();
+    }
+
+    ~Profiler() {
+        stop_export();
+    }
+
+  private:
+    struct StageCounters {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+        std::atomic<uint64_t> buckets[num_buckets]{};
+    };
+
+    struct alignas(64) ThreadCounters {
+        // free -> claiming -> live while its thread runs -> retired until the next export -> free
+        enum State : int { free, claiming, live, retired };
+        std::atomic<int> state{free};
+        char name[32]{};
+        StageCounters stages[num_stages];
+
+        void reset() {
+            for (StageCounters &c : stages) {
+                c.count.store(0, std::memory_order_relaxed);
+                c.total_ns.store(0, std::memory_order_relaxed);
+                c.max_ns.store(0, std::memory_order_relaxed);
+                for (auto &b : c.buckets)
+                    b.store(0, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // The calling thread's name and counters, which it retires when it exits
+    struct ThreadSlot {
+        char name[32]{};
+        ThreadCounters *counters = nullptr;
+
+        ~ThreadSlot() {
+            if (counters)
+                counters->state.store(ThreadCounters::retired, std::memory_order_release);
+        }
+    };
+
+    struct StageSnapshot {
+        uint64_t count = 0;
+        uint64_t total_ns = 0;
+        uint64_t buckets[num_buckets]{};
+    };
+
+    std::atomic<bool> is_enabled{false};
+    ThreadCounters threads[max_threads];
+
+    std::mutex export_mutex;
+    StageSnapshot snapshots[max_threads][num_stages];
+
+    std::thread export_thread;
+    std::mutex export_wait_mutex;
+    std::condition_variable export_cv;
+    bool exporting = false;
+    std::ofstream export_file;
+
+    Profiler() = default;
+
+    // Only the owning thread writes its counters, so a plain load and store is enough
+    static void add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static size_t bucket(uint64_t ns) {
+        const uint64_t us = ns / 1000;
+        size_t b = 0;
+        while (b + 1 < num_buckets && (1ull << b) <= us)
+            b++;
+        return b;
+    }
+
+    // Upper bound in us of the bucket holding the given fraction of samples
+    static double percentile(const uint64_t *buckets, uint64_t count, double fraction) {
+        const uint64_t target = (uint64_t)std::ceil((double)count * fraction);
+        uint64_t seen = 0;
+        for (size_t b = 0; b < num_buckets; b++) {
+            seen += buckets[b];
+            if (seen >= target)
+                return (double)(1ull << b);
+        }
+        return (double)(1ull << (num_buckets - 1));
+    }
+
+    static ThreadSlot &thread_slot() {
+        thread_local ThreadSlot slot;
+        return slot;
+    }
+
+    // Null while all slots are taken, the caller tries again with its next sample
+    ThreadCounters *claim_thread(const char *name) {
+        for (size_t t = 0; t < max_threads; t++) {
+            ThreadCounters &counters = threads[t];
+            int expected = ThreadCounters::free;
+            if (!counters.state.compare_exchange_strong(expected, ThreadCounters::claiming, std::memory_order_acquire))
+                continue;
+            const std::string fallback = "thread" + std::to_string(t);
+            std::strncpy(counters.name, *name ? name : fallback.c_str(), sizeof(counters.name) - 1);
+            counters.state.store(ThreadCounters::live, std::memory_order_release);
+            return &counters;
+        }
+        return nullptr;
+    }
+
+    // Writes s as a JSON string, thread names can hold user supplied device names
+    static void write_string(std::ostream &os, const char *s) {
+        os << '"';
+        for (; *s; s++) {
+            const unsigned char c = *s;
+            if (c == '"' || c == '\\') {
+                os << '\\' << c;
+            } else if (c < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                os << escaped;
+            } else {
+                os << c;
+            }
+        }
+        os << '"';
+    }
+};
+
+// Times the enclosing scope as one sample of a stage while the profiler is enabled
+class StageTimer {
+  public:
+    explicit StageTimer(Stage stage) : stage(stage), enabled(Profiler::instance().enabled()) {
+        if (enabled)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer() {
+        if (enabled)
+            Profiler::instance().record(stage, std::chrono::steady_clock::now() - start);
+    }
+
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+  private:
+    const Stage stage;
+    const bool enabled;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Timeline of the one off startup phases, which overlap when they run on different threads.
+// Phases are reported as start-end in ms since the timer was created.
+class StartupTimer {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    class Phase {
+      public:
+        Phase(StartupTimer &timer, std::string name) : timer(timer), name(std::move(name)), start(clock::now()) {}
+
+        ~Phase() {
+            end();
+        }
+
+        void rename(std::string new_name) {
+            name = std::move(new_name);
+        }
+
+        // Ends the phase before the end of the scope, later calls do nothing
+        void end() {
+            if (!ended)
+                timer.add(name, start, clock::now());
+            ended = true;
+        }
+
+        Phase(const Phase &) = delete;
+        Phase &operator=(const Phase &) = delete;
+
+      private:
+        StartupTimer &timer;
+        std::string name;
+        const clock::time_point start;
+        bool ended = false;
+    };
+
+    StartupTimer() : origin(clock::now()) {}
+
+    // Records a point in time rather than a phase, eg the first frame
+    void mark(const std::string &name) {
+        const auto now = clock::now();
+        add(name, now, now);
+    }
+
+    void report(std::ostream &os) const {
+        std::lock_guard lock(mutex);
+        os << "startup:";
+        for (size_t i = 0; i < events.size(); i++) {
+            const Event &e = events[i];
+            os << (i ? ", " : " ") << e.name << " ";
+            if (e.end_ms != e.start_ms)
+                os << std::lround(e.start_ms) << "-";
+            os << std::lround(e.end_ms) << " ms";
+        }
+        os << std::endl;
+    }
+
+  private:
+    struct Event {
+        std::string name;
+        double start_ms;
+        double end_ms;
+    };
+
+    const clock::time_point origin;
+    mutable std::mutex mutex;
+    std::vector<Event> events;
+
+    void add(const std::string &name, clock::time_point start, clock::time_point end) {
+        auto ms = [this](clock::time_point t) {
+            return std::chrono::duration<double, std::milli>(t - origin).count();
+        };
+        std::lock_guard lock(mutex);
+        events.push_back({name, ms(start), ms(end)});
+    }
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <mutex>
+#include <algorithm>
+#include <ostream>
+
+// Picks the highest frame rate a board keeps up with from the measured upload times.
+// Every completed frame feeds in how long its packets took to be acknowledged, which
+// is scaled up to a full frame so frames that skipped unchanged packets still count.
+// The rate follows the smoothed full frame time with some headroom kept free, drops
+// straight away when uploads slow down and halves when a transfer fails or times out.
+// on_frame() and the getters may be called from different threads.
+class FrameRateController {
+  public:
+    struct Options {
+        double min_fps = 10;
+        double max_fps = 240;
+        // fraction of each frame period left idle
+        double headroom = 0.2;
+        // weight of the newest upload time in the running average
+        double smoothing = 0.1;
+        // how quickly the rate climbs back towards the measured limit, per frame
+        double rise = 0.05;
+        // packets in a full frame
+        size_t frame_packets = 7;
+    };
+
+    struct Stats {
+        double fps = 0;
+        // smoothed time to upload every packet of a frame
+        double frame_ms = 0;
+        double max_frame_ms = 0;
+        // fraction of the chosen frame period the uploads leave idle
+        double headroom = 0;
+        uint64_t frames = 0;
+        uint64_t errors = 0;
+    };
+
+    FrameRateController() : FrameRateController(Options{}) {}
+
+    explicit FrameRateController(const Options &options) : options(options), rate(options.min_fps) {}
+
+    // packets is how many packets the frame actually sent, error is non zero if any of them failed
+    void on_frame(std::chrono::steady_clock::duration elapsed, size_t packets, int error) {
+        std::lock_guard lock(mutex);
+        frames++;
+        if (error != 0) {
+            errors++;
+            rate = std::max(rate / 2, options.min_fps);
+            return;
+        }
+        // frames with nothing changed say nothing about the board but still keep the rate climbing
+        if (packets > 0) {
+            const double frame_s = std::chrono::duration<double>(elapsed).count() * options.frame_packets / packets;
+            avg_frame_s = avg_frame_s > 0 ? avg_frame_s + (frame_s - avg_frame_s) * options.smoothing : frame_s;
+            max_frame_s = std::max(max_frame_s, frame_s);
+        }
+
+        const double limit = avg_frame_s > 0
+            ? std::clamp((1.0 - options.headroom) / avg_frame_s, options.min_fps, options.max_fps)
+            : options.max_fps;
+        rate = limit < rate ? limit : rate + (limit - rate) * options.rise;
+    }
+
+    double fps() const {
+        std::lock_guard lock(mutex);
+        return rate;
+    }
+
+    Stats stats() const {
+        std::lock_guard lock(mutex);
+        Stats s;
+        s.fps = rate;
+        s.frame_ms = avg_frame_s * 1000.0;
+        s.max_frame_ms = max_frame_s * 1000.0;
+        s.headroom = 1.0 - avg_frame_s * rate;
+        s.frames = frames;
+        s.errors = errors;
+        return s;
+    }
+
+    void reset_stats() {
+        std::lock_guard lock(mutex);
+        max_frame_s = 0;
+        frames = 0;
+        errors = 0;
+    }
+
+  private:
+    const Options options;
+    mutable std::mutex mutex;
+    double rate;
+    double avg_frame_s = 0;
+    double max_frame_s = 0;
+    uint64_t frames = 0;
+    uint64_t errors = 0;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const FrameRateController::Stats &s) {
+    return os << s.fps << " fps, upload " << s.frame_ms << " ms (max " << s.max_frame_ms << " ms), "
+              << std::lround(s.headroom * 100) << "% headroom, " << s.errors << "/" << s.frames << " frames failed";
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mk_pro_m.h"
+#include "spectrum_bars.h"
+
+// Binary recordings of the frames sent to the board.
+//
+// A file is a header followed by one record per frame. Each frame is the spectrum
+// bars it was rendered from (if any) and the num_leds values in packet order, ie
+// the payloads of the SetLedsData packets. Records only store the bytes that
+// changed since the previous frame:
+//   varint  microseconds since the previous frame
+//   uint8   flags, bit 0 set if the frame has bars
+//   varint  size of the runs below
+//   runs    varint skip, varint length, length literal bytes
+// Runs cover the bars followed by the LEDs, skipped bytes keep their previous value.
+
+struct RecordingFormat {
+    static constexpr char magic[8] = {'M', 'K', 'R', 'E', 'C', 0, 0, 0};
+    static const uint32_t version = 1;
+    static const uint8_t has_bars = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_bars;
+        uint32_t num_leds;
+        uint32_t reserved;
+    };
+
+    static const size_t frame_size = num_bars + CMMKProM::num_leds * sizeof(RGB);
+};
+
+class FrameRecorder {
+  public:
+    explicit FrameRecorder(const std::string &path) : file(path, std::ios::binary | std::ios::trunc) {
+        if (!file)
+            throw std::runtime_error("Failed to create recording " + path);
+
+        RecordingFormat::Header header{};
+        std::memcpy(header.magic, RecordingFormat::magic, sizeof(header.magic));
+        header.version = RecordingFormat::version;
+        header.num_bars = num_bars;
+        header.num_leds = CMMKProM::num_leds;
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        runs.reserve(2 * RecordingFormat::frame_size);
+        record.reserve(2 * RecordingFormat::frame_size);
+        last_time = std::chrono::steady_clock::now();
+    }
+
+    // bars may be null for frames that were not rendered from a spectrum
+    void write(const uint8_t *bars, const RGB *leds) {
+        const auto now = std::chrono::steady_clock::now();
+        const uint64_t delta_us = std::chrono::duration_cast<std::chrono::microseconds>(now - last_time).count();
+        last_time = now;
+
+        uint8_t frame[RecordingFormat::frame_size];
+        if (bars)
+            std::memcpy(frame, bars, num_bars);
+        else
+            std::memset(frame, 0, num_bars);
+        std::memcpy(frame + num_bars, leds, CMMKProM::num_leds * sizeof(RGB));
+
+        encode_runs(prev, frame);
+        std::memcpy(prev, frame, sizeof(frame));
+
+        record.clear();
+        put_varint(record, delta_us);
+        record.push_back(bars ? RecordingFormat::has_bars : 0);
+        put_varint(record, runs.size());
+        record.insert(record.end(), runs.begin(), runs.end());
+        file.write(reinterpret_cast<const char *>(record.data()), record.size());
+        if (!file)
+            throw std::runtime_error("Failed to write recording");
+        frames++;
+    }
+
+    uint64_t frame_count() const {
+        return frames;
+    }
+
+  private:
+    std::ofstream file;
+    uint8_t prev[RecordingFormat::frame_size]{};
+    std::vector<uint8_t> runs;
+    std::vector<uint8_t> record;
+    std::chrono::steady_clock::time_point last_time;
+    uint64_t frames = 0;
+
+    static void put_varint(std::vector<uint8_t> &out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((uint8_t)value);
+    }
+
+    void encode_runs(const uint8_t *old, const uint8_t *cur) {
+        const size_t n = RecordingFormat::frame_size;
+        runs.clear();
+        size_t i = 0;
+        size_t last = 0;
+        while (i < n) {
+            if (cur[i] == old[i]) {
+                i++;
+                continue;
+            }
+
+            // a run ends at two unchanged bytes in a row, shorter gaps are cheaper inline
+            const size_t begin = i;
+            while (i < n && (cur[i] != old[i] || (i + 1 < n && cur[i + 1] != old[i + 1])))
+                i++;
+            put_varint(runs, begin - last);
+            put_varint(runs, i - begin);
+            runs.insert(runs.end(), cur + begin, cur + i);
+            last = i;
+        }
+    }
+};
+
+// Read only mapping of a recording, any number of Readers can walk it at once
+class FrameRecording {
+  public:
+    struct Frame {
+        // time since the start of the recording
+        std::chrono::microseconds time{0};
+        bool has_bars = false;
+        uint8_t bars[num_bars]{};
+        RGB leds[CMMKProM::num_leds]{};
+    };
+
+    class Reader {
+      public:
+        explicit Reader(const FrameRecording &recording)
+            : pos(recording.data + sizeof(RecordingFormat::Header)), end(recording.data + recording.size) {}
+
+        // Decodes the next frame into frame, which must be the one passed to the previous call.
+        // Returns false at the end of the recording.
+        bool next(Frame &frame) {
+            if (pos == end)
+                return false;
+
+            frame.time += std::chrono::microseconds(get_varint());
+            const uint8_t flags = get_byte();
+            const uint64_t size = get_varint();
+            if (size > (uint64_t)(end - pos))
+                throw std::runtime_error("Truncated recording");
+
+            const uint8_t *runs_end = pos + size;
+            uint8_t state[RecordingFormat::frame_size];
+            std::memcpy(state, frame.bars, num_bars);
+            std::memcpy(state + num_bars, frame.leds, sizeof(frame.leds));
+            size_t offset = 0;
+            while (pos < runs_end) {
+                // checked against the space left so neither addition can wrap
+                const uint64_t skip = get_varint();
+                if (skip > sizeof(state) - offset)
+                    throw std::runtime_error("Corrupt recording");
+                offset += skip;
+                const uint64_t length = get_varint();
+                if (length > sizeof(state) - offset || length > (uint64_t)(runs_end - pos))
+                    throw std::runtime_error("Corrupt recording");
+                std::memcpy(state + offset, pos, length);
+                pos += length;
+                offset += length;
+            }
+            if (pos != runs_end)
+                throw std::runtime_error("Corrupt recording");
+
+            frame.has_bars = flags & RecordingFormat::has_bars;
+            std::memcpy(frame.bars, state, num_bars);
+            std::memcpy(frame.leds, state + num_bars, sizeof(frame.leds));
+            return true;
+        }
+
+      private:
+        const uint8_t *pos;
+        const uint8_t *end;
+
+        uint8_t get_byte() {
+            if (pos == end)
+                throw std::runtime_error("Truncated recording");
+            return *pos++;
+        }
+
+        uint64_t get_varint() {
+            uint64_t value = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7) {
+                const uint8_t byte = get_byte();
+                value |= (uint64_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return value;
+            }
+            throw std::runtime_error("Corrupt recording");
+        }
+    };
+
+    explicit FrameRecording(const std::string &path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open recording " + path + ": " + std::strerror(errno));
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(RecordingFormat::Header)) {
+            close(fd);
+            throw std::runtime_error(path + " is not a recording");
+        }
+        size = st.st_size;
+        void *mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED)
+            throw std::runtime_error("Failed to map recording " + path);
+        data = static_cast<const uint8_t *>(mem);
+        madvise(mem, size, MADV_SEQUENTIAL);
+
+        RecordingFormat::Header header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, RecordingFormat::magic, sizeof(header.magic)) != 0
+            || header.version != RecordingFormat::version) {
+            munmap(mem, size);
+            throw std::runtime_error(path + " is not a recording");
+        }
+        if (header.num_bars != num_bars || header.num_leds != CMMKProM::num_leds) {
+            munmap(mem, size);
+            throw std::runtime_error(path + " was recorded with a different layout");
+        }
+    }
+
+    ~FrameRecording() {
+        munmap(const_cast<uint8_t *>(data), size);
+    }
+
+    FrameRecording(const FrameRecording &) = delete;
+    FrameRecording &operator=(const FrameRecording &) = delete;
+
+  private:
+    const uint8_t *data;
+    size_t size;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+// Decides from the raw samples of each hop whether anything is playing.
+// The input counts as silent once the RMS level and the peak have both stayed under
+// the threshold for the hold time; a single hop above it ends the silence at once.
+// Time is counted in samples so offline input behaves like live capture.
+class SilenceGate {
+  public:
+    struct Options {
+        double threshold_db = -60;
+        double hold_seconds = 2;
+        // peaks may exceed the RMS threshold by this much before they count as signal
+        double peak_margin_db = 12;
+    };
+
+    SilenceGate(const Options &options, size_t sample_rate)
+        : rms_threshold(db_to_amplitude(options.threshold_db)),
+          peak_threshold(db_to_amplitude(options.threshold_db + options.peak_margin_db)),
+          hold_samples((uint64_t)(options.hold_seconds * sample_rate)) {}
+
+    // Feeds the next hop, returns true while the input is silent
+    bool update(const float *samples, size_t count) {
+        float sum = 0;
+        float peak = 0;
+        for (size_t i = 0; i < count; i++) {
+            sum += samples[i] * samples[i];
+            peak = std::max(peak, std::fabs(samples[i]));
+        }
+        last_rms = count ? std::sqrt(sum / (float)count) : 0.0f;
+
+        if (last_rms >= rms_threshold || peak >= peak_threshold) {
+            quiet_samples = 0;
+            silent = false;
+        } else {
+            quiet_samples += count;
+            silent = quiet_samples >= hold_samples;
+        }
+        return silent;
+    }
+
+    bool is_silent() const {
+        return silent;
+    }
+
+    // RMS level of the last hop in dBFS
+    double rms_db() const {
+        return 20.0 * std::log10(std::max(last_rms, 1e-10f));
+    }
+
+  private:
+    const float rms_threshold;
+    const float peak_threshold;
+    const uint64_t hold_samples;
+    uint64_t quiet_samples = 0;
+    float last_rms = 0;
+    bool silent = false;
+
+    static float db_to_amplitude(double db) {
+        return (float)std::pow(10.0, db / 20.0);
+    }
+};
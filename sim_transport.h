@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#include <array>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include "mk_pro_m.h"
+#include "profiler.h"
+#include "transport.h"
+
+// A simulated MasterKeys board for running the upload path without hardware.
+// It decodes the LED control and SetLedsData reports into a virtual LED state and
+// acknowledges every report by echoing it back, like the real board.
+class SimTransport : public Transport {
+  public:
+    static const size_t max_leds = 256;
+
+    struct Options {
+        // time the board takes to answer one report
+        std::chrono::microseconds latency{0};
+        // probability that a SetLedsData report is acknowledged but not applied
+        double drop_rate = 0;
+        // libusb error every SetLedsData exchange fails with, like an unplugged board, 0 for none
+        int led_error = 0;
+        uint32_t seed = 1;
+    };
+
+    struct Counters {
+        uint64_t reports = 0;
+        uint64_t led_packets = 0;
+        uint64_t dropped = 0;
+        uint64_t failed = 0;
+        uint64_t unknown = 0;
+        uint64_t batches = 0;
+    };
+
+    SimTransport() : SimTransport(Options{}) {}
+
+    explicit SimTransport(const Options &options) : options(options), rng(options.seed) {}
+
+    ~SimTransport() {
+        stop_async();
+    }
+
+    void send_command(const uint8_t *data, uint8_t *recv_data, size_t size) override {
+        if (options.latency.count() > 0)
+            std::this_thread::sleep_for(options.latency);
+
+        if (fails(data, size))
+            throw std::runtime_error("Simulated transfer error " + std::to_string(options.led_error));
+
+        std::lock_guard lock(state_mutex);
+        decode(data, size);
+        std::memmove(recv_data, data, size);
+    }
+
+    // Batches are answered on a worker thread, so submit() returns straight away like on USB
+    void start_async(size_t max_exchanges, size_t size, Completion on_done) override {
+        if (worker.joinable())
+            return;
+
+        batch.reserve(max_exchanges);
+        in_progress.reserve(max_exchanges);
+        async_size = size;
+        async_done = std::move(on_done);
+        worker_running = true;
+        worker = std::thread(&SimTransport::run_batches, this);
+    }
+
+    void submit(const Exchange *exchanges, size_t count) override {
+        {
+            std::lock_guard lock(batch_mutex);
+            batch.assign(exchanges, exchanges + count);
+            batch_queued = true;
+        }
+        batch_cv.notify_all();
+    }
+
+    void stop_async() override {
+        if (!worker.joinable())
+            return;
+
+        {
+            std::lock_guard lock(batch_mutex);
+            worker_running = false;
+        }
+        batch_cv.notify_all();
+        worker.join();
+        async_done = nullptr;
+    }
+
+    bool led_control_enabled() {
+        std::lock_guard lock(state_mutex);
+        return enabled;
+    }
+
+    // LED values in the order the board indexes them
+    std::array<RGB, max_leds> leds() {
+        std::lock_guard lock(state_mutex);
+        return led_state;
+    }
+
+    // LED values laid out on the key map, cells without a key are black
+    void get_matrix(CMMKProM::led_matrix matrix) {
+        std::lock_guard lock(state_mutex);
+        for (size_t y = 0; y < CMMKProM::key_map_rows; y++) {
+            for (size_t x = 0; x < CMMKProM::key_map_cols; x++) {
+                const ssize_t key = CMMKProM::key_map[y][x];
+                matrix[y][x] = key < 0 ? RGB{} : led_state[key];
+            }
+        }
+    }
+
+    Counters counters() {
+        std::lock_guard lock(state_mutex);
+        return stats;
+    }
+
+  private:
+    const Options options;
+    std::mt19937 rng;
+
+    std::mutex state_mutex;
+    bool enabled = false;
+    std::array<RGB, max_leds> led_state{};
+    Counters stats;
+
+    std::thread worker;
+    std::mutex batch_mutex;
+    std::condition_variable batch_cv;
+    std::vector<Exchange> batch;
+    std::vector<Exchange> in_progress;
+    bool batch_queued = false;
+    bool worker_running = false;
+
+    bool fails(const uint8_t *data, size_t size) {
+        if (options.led_error == 0 || size < 2 || data[0] != 0xc0 || data[1] != 0x02)
+            return false;
+        std::lock_guard lock(state_mutex);
+        stats.failed++;
+        return true;
+    }
+
+    // Called with state_mutex held
+    void decode(const uint8_t *data, size_t size) {
+        stats.reports++;
+        if (size >= 2 && data[0] == 0x41) {
+            enabled = data[1] == 2;
+            return;
+        }
+
+        const size_t leds_offset = 4;
+        if (size < leds_offset || data[0] != 0xc0 || data[1] != 0x02) {
+            stats.unknown++;
+            return;
+        }
+
+        stats.led_packets++;
+        if (options.drop_rate > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < options.drop_rate) {
+            stats.dropped++;
+            return;
+        }
+
+        // the third byte is twice the packet index
+        const size_t leds_per_packet = CMMKProM::leds_per_packet;
+        const size_t payload_leds = std::min((size - leds_offset) / sizeof(RGB), leds_per_packet);
+        const size_t first = (data[2] / 2) * leds_per_packet;
+        for (size_t i = 0; i < payload_leds && first + i < max_leds; i++)
+            std::memcpy(&led_state[first + i], data + leds_offset + i * sizeof(RGB), sizeof(RGB));
+    }
+
+    void run_batches() {
+        Profiler::name_thread(("sim_board " + std::to_string(options.seed)).c_str());
+        std::unique_lock lock(batch_mutex);
+        while (true) {
+            batch_cv.wait(lock, [this] { return batch_queued || !worker_running; });
+            if (!batch_queued)
+                return;
+            batch_queued = false;
+            in_progress.swap(batch);
+            lock.unlock();
+
+            // like libusb, the first failed exchange ends the batch
+            int error = 0;
+            for (const Exchange &exchange : in_progress) {
+                if (fails(exchange.out, async_size)) {
+                    error = options.led_error;
+                    break;
+                }
+                send_command(exchange.out, exchange.in, async_size);
+            }
+            {
+                std::lock_guard state_lock(state_mutex);
+                stats.batches++;
+            }
+            async_done(error);
+
+            lock.lock();
+        }
+    }
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#include "mk_pro_m.h"
+
+const size_t num_bars = 30;
+
+constexpr ssize_t matrix_to_bar[CMMKProM::key_map_rows][CMMKProM::key_map_cols] = {
+    //                                    V
+    {27, 26, 21, 20, 15, 14,  9,  8,  3,  2,  3,  8,  9, 14, 15, 20, 21, 26, 27},
+    {28, 25, 22, 19, 16, 13, 10,  7,  4,  1,  4,  7, 10, 13, 16, 19, 22, 25, 28},
+    {29, 24, 23, 18, 17, 12, 11,  6,  5,  0,  5,  6, 11, 12, 17, 18, 23, 24, 29},
+    {29, 24, 23, 18, 17, 12, 11,  6,  5,  0,  5,  6, 11, 12, 17, 18, 23, 24, 29},
+    {28, 25, 22, 19, 16, 13, 10,  7,  4,  1,  4,  7, 10, 13, 16, 19, 22, 25, 28},
+    {27, 26, 21, 20, 15, 14,  9,  8,  3,  2,  3,  8,  9, 14, 15, 20, 21, 26, 27},
+};
+
+// matrix_to_bar folded into the key scales, for CMMKProM::set_leds_from_bars
+static constexpr auto bar_key_table = CMMKProM::make_bar_table<num_bars, matrix_to_bar>();
+
+// matrix_to_bar folded into the key scales with Q14 weights, for the integer path
+static constexpr auto fixed_bar_key_table = quantise(bar_key_table);
+
+// Turns raw spectrum bars into brightness values, scaling by a running average of
+// the loudest bar so quiet music still fills the range
+struct BarNormaliser {
+    float avg_max_weight = 0.8f;
+    float avg_max = 0;
+
+    // pow(x, 1.5) in Q12 for x in [0, gamma_lut_range], used by normalise_fixed
+    static const size_t gamma_lut_size = 4096;
+    static constexpr float gamma_lut_range = 2.0f;
+    static constexpr auto gamma_lut = MakeArray<uint16_t, gamma_lut_size>(
+        [](size_t size, auto arr) constexpr -> void {
+            for (size_t i = 0; i < size; i++) {
+                const double x = gamma_lut_range * (double)i / (double)(size - 1);
+                double root = x > 1 ? x : 1;
+                for (int j = 0; j < 32; j++)
+                    root = (root + x / root) / 2;
+                arr[i] = (uint16_t)(x * root * 4096.0 + 0.5);
+            }
+        }
+    );
+
+    void normalise(const float *bar_data, uint8_t *out_bar_data) {
+        const float scale = std::clamp(1 / std::max(avg_max, 0.1f), 1.f, 10.f);
+        float max = 0;
+        for (size_t i = 0; i < num_bars; i++) {
+            float val = std::pow(bar_data[i], 1.5f);
+            max = std::max(max, val);
+            out_bar_data[i] = (uint8_t)(std::clamp(val * scale * 255.0f, 1.0f, 255.0f));
+        }
+        avg_max = avg_max_weight * avg_max + (1.f - avg_max_weight) * max;
+    }
+
+    // Same as normalise with pow replaced by gamma_lut and the scaling done in integers.
+    // Bars above gamma_lut_range count as gamma_lut_range, they are full brightness either way.
+    // This is for builds where powf is a scalar call: about 4x faster than normalise at -O2.
+    // With -ffast-math on x86-64 glibc vectorises powf, and normalise is about 1.5x faster.
+    void normalise_fixed(const float *bar_data, uint8_t *out_bar_data) {
+        const float scale = std::clamp(1 / std::max(avg_max, 0.1f), 1.f, 10.f);
+        // scale * 255 in Q4, so a Q12 value times it stays under 2^32
+        const uint32_t gain = (uint32_t)(scale * 255.0f * 16.0f);
+        const float to_index = (float)(gamma_lut_size - 1) / gamma_lut_range;
+        uint32_t max = 0;
+        for (size_t i = 0; i < num_bars; i++) {
+            const int32_t index = (int32_t)std::clamp(bar_data[i] * to_index + 0.5f, 0.0f, (float)(gamma_lut_size - 1));
+            const uint32_t val = gamma_lut.arr[index];
+            max = std::max(max, val);
+            out_bar_data[i] = (uint8_t)std::clamp<uint32_t>((val * gain) >> 16, 1, 255);
+        }
+        avg_max = avg_max_weight * avg_max + (1.f - avg_max_weight) * ((float)max / 4096.0f);
+    }
+};
+
+// Spreads the bars over the red channel of the matrix
+static inline void bars_to_matrix(const uint8_t *bars, CMMKProM::led_matrix matrix) {
+    for (size_t x = 0; x < CMMKProM::key_map_cols; x++) {
+        for (size_t y = 0; y < CMMKProM::key_map_rows; y++) {
+            matrix[y][x].r = bars[matrix_to_bar[y][x]];
+        }
+    }
+}
@@ -0,0 +1,65 @@
+// Runs a DeviceGroup over simulated boards where one, then every board fails all of
+// its LED exchanges, and checks that the group drops them instead of retrying forever.
+// Run by `make check`, exits non-zero on failure.
+
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <chrono>
+
+#include "../device_group.h"
+#include "../sim_transport.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static std::unique_ptr<CMMKProM> board(int led_error) {
+    SimTransport::Options options;
+    options.led_error = led_error;
+    return std::make_unique<CMMKProM>(std::make_unique<SimTransport>(options));
+}
+
+// Publishes changing frames until the group reports board i failed, or gives up after two seconds
+static bool publish_until_failed(DeviceGroup &group, size_t i) {
+    RGB leds[CMMKProM::num_leds]{};
+    for (int frame = 0; frame < 2000 && !group.failed(i); frame++) {
+        leds[frame % CMMKProM::num_leds].r = (uint8_t)frame;
+        group.publish(leds);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return group.failed(i);
+}
+
+int main() {
+    {
+        DeviceGroup group;
+        group.add(board(0), "working");
+        group.add(board(LIBUSB_ERROR_IO), "failing");
+        group.start();
+        check(publish_until_failed(group, 1), "a board whose uploads all fail is dropped");
+        check(!group.failed(0), "the working board carries on");
+        check(!group.all_failed(), "one working board keeps the group up");
+        group.stop();
+        check(group.max_fps() == group.rate(0).fps(), "max_fps ignores the dropped board");
+    }
+    {
+        DeviceGroup group;
+        group.add(board(LIBUSB_ERROR_NO_DEVICE), "unplugged");
+        group.add(board(LIBUSB_ERROR_IO), "failing");
+        group.start();
+        check(publish_until_failed(group, 0), "an unplugged board is dropped");
+        check(publish_until_failed(group, 1), "the failing board is dropped");
+        check(group.all_failed(), "all_failed once every board failed");
+        group.stop();
+    }
+
+    if (failures == 0)
+        std::printf("device_group_check: ok\n");
+    return failures == 0 ? 0 : 1;
+}
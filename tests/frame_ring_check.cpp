@@ -0,0 +1,113 @@
+// Forks a producer that publishes frames into a FrameRing while this process reads
+// them back as the daemon, and checks that only complete frames are ever read.
+// Also checks that a live ring is not taken over and a stale one is.
+// Run by `make check`, exits non-zero on failure.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../frame_ring.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static const uint64_t num_frames = 20000;
+
+static uint8_t pattern(uint64_t seq) {
+    return (uint8_t)(seq * 31 + 7);
+}
+
+// Fills every byte of frame seq with its pattern one cell at a time, so a torn read mixes values
+static void produce(const std::string &name) {
+    FrameRing ring = FrameRing::open(name);
+    for (uint64_t i = 0; i < num_frames; i++) {
+        uint64_t seq;
+        CMMKProM::led_matrix &matrix = ring.claim(seq);
+        for (size_t y = 0; y < CMMKProM::key_map_rows; y++)
+            for (size_t x = 0; x < CMMKProM::key_map_cols; x++)
+                matrix[y][x] = {pattern(seq), pattern(seq), pattern(seq)};
+        ring.publish(seq);
+    }
+}
+
+static bool complete(const CMMKProM::led_matrix matrix, uint64_t seq) {
+    const uint8_t *bytes = &matrix[0][0].r;
+    for (size_t i = 0; i < sizeof(CMMKProM::led_matrix); i++) {
+        if (bytes[i] != pattern(seq))
+            return false;
+    }
+    return true;
+}
+
+static bool create_fails(const std::string &name) {
+    try {
+        FrameRing::create(name);
+    } catch (std::runtime_error &) {
+        return true;
+    }
+    return false;
+}
+
+int main() {
+    const std::string name = "/mk_pro_m_check_" + std::to_string(getpid());
+    {
+        FrameRing ring = FrameRing::create(name, 4);
+        check(create_fails(name), "a live ring is not taken over");
+
+        const pid_t producer = fork();
+        if (producer == 0) {
+            produce(name);
+            _exit(0);
+        }
+
+        uint64_t last_seq = 0;
+        uint64_t frames = 0;
+        bool torn = false;
+        bool producer_done = false;
+        CMMKProM::led_matrix matrix;
+        while (last_seq < num_frames) {
+            const uint32_t wake_count = ring.wake_counter();
+            if (ring.read_latest(last_seq, matrix)) {
+                torn |= !complete(matrix, last_seq - 1);
+                frames++;
+                continue;
+            }
+            if (producer_done)
+                break;
+            int status;
+            producer_done = waitpid(producer, &status, WNOHANG) == producer;
+            if (!producer_done)
+                ring.wait(wake_count, std::chrono::milliseconds(100));
+        }
+        if (!producer_done)
+            waitpid(producer, nullptr, 0);
+
+        check(frames > 0, "frames were read");
+        check(!torn, "only complete frames are read");
+        check(last_seq == num_frames, "the last frame is read");
+    }
+
+    // a daemon that exits without its destructor leaves a ring nobody holds the lock on
+    const pid_t crashed = fork();
+    if (crashed == 0) {
+        FrameRing::create(name, 4);
+        _exit(0);
+    }
+    waitpid(crashed, nullptr, 0);
+    check(!create_fails(name), "a stale ring is replaced");
+    shm_unlink((name + ".lock").c_str());
+
+    if (failures == 0)
+        std::printf("frame_ring_check: ok\n");
+    return failures == 0 ? 0 : 1;
+}
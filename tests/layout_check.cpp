@@ -0,0 +1,111 @@
+// Instantiates CMMKDevice on a small made up layout, so the templating is compiled
+// for something other than the Pro M, and checks the uploaded packets against it.
+// Run by `make check`, exits non-zero on failure.
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include "../mk_pro_m.h"
+
+// Two packets, keys on both of them, one key two cells wide
+struct TestLayout {
+    static constexpr uint16_t usb_vendor_id = 0x2516;
+    static constexpr uint16_t usb_product_id = 0xffff;
+    static constexpr int usb_interface = 1;
+    static constexpr unsigned char usb_endpoint_out = 4 | LIBUSB_ENDPOINT_OUT;
+    static constexpr unsigned char usb_endpoint_in = 3 | LIBUSB_ENDPOINT_IN;
+    static constexpr unsigned int usb_timeout_ms = 100;
+    static constexpr size_t packet_size = 64;
+    static constexpr size_t num_packets = 2;
+    static constexpr size_t leds_per_packet = 16;
+
+    static constexpr size_t key_map_cols = 4;
+    static constexpr size_t key_map_rows = 2;
+    static constexpr ssize_t key_map[key_map_rows][key_map_cols] = {
+        { 0,  1,  2,  3},
+        {16, 17, -1, 31},
+    };
+
+    static constexpr size_t big_key_map_rows = key_map_rows;
+    static constexpr size_t big_key_map_cols = key_map_cols * 2;
+    static constexpr ssize_t big_key_map[big_key_map_rows][big_key_map_cols] = {
+        { 0,  0,  1,  1,  2,  2,  3,  3},
+        {16, 16, 17, 17, 17, 17, 31, 31},
+    };
+};
+
+using TestDevice = CMMKDevice<TestLayout>;
+
+static_assert(TestDevice::num_leds == 32);
+static_assert(TestDevice::num_keys == 7);
+static_assert(TestDevice::max_key_id == 31);
+static_assert(TestDevice::max_key_cells == 2);
+
+// Decodes the SetLedsData reports it is sent
+class CaptureTransport : public Transport {
+  public:
+    RGB leds[TestDevice::num_leds]{};
+    bool enabled = false;
+
+    void send_command(const uint8_t *data, uint8_t *recv_data, size_t size) override {
+        if (data[0] == 0x41) {
+            enabled = data[1] == 2;
+        } else if (data[0] == 0xc0 && data[1] == 0x02) {
+            const size_t first = (data[2] / 2) * TestDevice::leds_per_packet;
+            std::memcpy(&leds[first], data + 4, TestDevice::leds_per_packet * sizeof(RGB));
+        }
+        std::memmove(recv_data, data, size);
+    }
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+int main() {
+    auto capture = std::make_unique<CaptureTransport>();
+    CaptureTransport &board = *capture;
+    TestDevice kb(std::move(capture));
+    check(board.enabled, "LED control enabled on construction");
+
+    TestDevice::led_matrix matrix{};
+    for (size_t y = 0; y < TestLayout::key_map_rows; y++)
+        for (size_t x = 0; x < TestLayout::key_map_cols; x++)
+            matrix[y][x] = {(uint8_t)(10 * (y * TestLayout::key_map_cols + x) + 10), (uint8_t)x, (uint8_t)y};
+
+    kb.set_leds(matrix);
+    bool all_keys = true;
+    for (size_t y = 0; y < TestLayout::key_map_rows; y++) {
+        for (size_t x = 0; x < TestLayout::key_map_cols; x++) {
+            const ssize_t key = TestLayout::key_map[y][x];
+            if (key >= 0 && std::memcmp(&board.leds[key], &matrix[y][x], sizeof(RGB)) != 0)
+                all_keys = false;
+        }
+    }
+    check(all_keys, "set_leds puts every cell on its key's LED");
+
+    // key 17 covers cells (1, 1) and (1, 2) equally, the others only their own cell
+    kb.set_leds_smooth(matrix, true);
+    check(board.leds[0].r == matrix[0][0].r, "set_leds_smooth keeps single cell keys");
+    check(board.leds[31].r == matrix[1][3].r, "set_leds_smooth reaches the second packet");
+    check(board.leds[17].r == (matrix[1][1].r + matrix[1][2].r) / 2, "set_leds_smooth averages wide keys");
+
+    RGB fixed[TestDevice::num_leds];
+    TestDevice::resample_fixed(matrix, fixed, true);
+    check(fixed[17].r == board.leds[17].r, "resample_fixed matches set_leds_smooth");
+
+    std::memset(matrix, 255, sizeof(matrix));
+    TestDevice::resample_fixed(matrix, fixed, true);
+    check(fixed[0].r == 255 && fixed[0].b == 255, "resample_fixed keeps full scale on single cell keys");
+    check(fixed[17].r == 255, "resample_fixed keeps full scale on wide keys");
+
+    if (failures == 0)
+        std::printf("layout_check: ok\n");
+    return failures == 0 ? 0 : 1;
+}
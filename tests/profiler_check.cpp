@@ -0,0 +1,58 @@
+// Checks that the profiler escapes thread names in its JSON lines, and that threads
+// only hold counter slots while they record and give them back when they exit.
+// Run by `make check`, exits non-zero on failure.
+
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "../profiler.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void run_thread(const char *name, bool record) {
+    std::thread([name, record] {
+        Profiler::name_thread(name);
+        if (record)
+            Profiler::instance().record(Stage::Upload, std::chrono::microseconds(5));
+    }).join();
+}
+
+static std::string export_json() {
+    std::ostringstream os;
+    Profiler::instance().write_json(os);
+    return os.str();
+}
+
+int main() {
+    Profiler &profiler = Profiler::instance();
+
+    // threads that never record, like workers started while profiling is off, take no slot
+    for (size_t i = 0; i < 2 * Profiler::max_threads; i++)
+        run_thread("idle", false);
+    profiler.set_enabled(true);
+    run_thread("upload \"kb\\1\"\n", true);
+    const std::string json = export_json();
+    check(json.find("\"thread\": \"upload \\\"kb\\\\1\\\"\\u000a\"") != std::string::npos, "thread names are escaped");
+
+    // more threads than slots over time, each exported before the next starts
+    bool all_exported = true;
+    for (size_t i = 0; i < 2 * Profiler::max_threads; i++) {
+        const std::string name = "worker " + std::to_string(i);
+        run_thread(name.c_str(), true);
+        all_exported &= export_json().find("\"thread\": \"" + name + "\"") != std::string::npos;
+    }
+    check(all_exported, "exited threads give their slots back");
+
+    if (failures == 0)
+        std::printf("profiler_check: ok\n");
+    return failures == 0 ? 0 : 1;
+}
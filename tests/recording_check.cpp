@@ -0,0 +1,71 @@
+// Round trips frames through FrameRecorder and FrameRecording, and checks that
+// corrupt records are rejected instead of decoded out of bounds.
+// Run by `make check`, exits non-zero on failure.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../recording.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static bool rejects(const std::string &path, const std::vector<uint8_t> &record) {
+    { FrameRecorder recorder(path); }
+    std::ofstream file(path, std::ios::binary | std::ios::app);
+    file.write(reinterpret_cast<const char *>(record.data()), record.size());
+    file.close();
+
+    FrameRecording recording(path);
+    FrameRecording::Reader reader(recording);
+    FrameRecording::Frame frame;
+    try {
+        reader.next(frame);
+    } catch (std::runtime_error &) {
+        return true;
+    }
+    return false;
+}
+
+int main() {
+    const std::string path = "tests/recording_check.rec";
+
+    uint8_t bars[num_bars]{};
+    RGB leds[CMMKProM::num_leds]{};
+    {
+        FrameRecorder recorder(path);
+        recorder.write(bars, leds);
+        bars[3] = 200;
+        leds[100] = {1, 2, 3};
+        recorder.write(bars, leds);
+        recorder.write(nullptr, leds);
+    }
+    {
+        FrameRecording recording(path);
+        FrameRecording::Reader reader(recording);
+        FrameRecording::Frame frame;
+        check(reader.next(frame) && frame.has_bars, "first frame");
+        check(reader.next(frame) && frame.bars[3] == 200 && frame.leds[100].g == 2, "delta frame");
+        check(reader.next(frame) && !frame.has_bars, "frame without bars");
+        check(!reader.next(frame), "end of recording");
+    }
+
+    // a skip of 2^64 - 1 would wrap the offset back into range
+    check(rejects(path, {0, 0, 12, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01, 1, 0x55}),
+          "skip past the frame");
+    // a run that starts on the last byte of the frame but is two bytes long
+    check(rejects(path, {0, 0, 5, 0xed, 0x02, 2, 0x55, 0x55}), "run past the frame");
+    std::remove(path.c_str());
+
+    if (failures == 0)
+        std::printf("recording_check: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+// Drives CMMKProM through SimTransport and compares what the simulated board decoded
+// with what was sent, in sync and async mode.
+// Run by `make check`, exits non-zero on failure.
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+
+#include "../mk_pro_m.h"
+#include "../sim_transport.h"
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::printf("FAIL: %s\n", what.c_str());
+        failures++;
+    }
+}
+
+static void random_matrix(std::mt19937 &rng, CMMKProM::led_matrix matrix) {
+    std::uniform_int_distribution<int> byte(0, 255);
+    for (size_t y = 0; y < CMMKProM::key_map_rows; y++)
+        for (size_t x = 0; x < CMMKProM::key_map_cols; x++)
+            matrix[y][x] = {(uint8_t)byte(rng), (uint8_t)byte(rng), (uint8_t)byte(rng)};
+}
+
+// True if every key shows its cell of matrix
+static bool board_shows(SimTransport &sim, const CMMKProM::led_matrix matrix) {
+    CMMKProM::led_matrix decoded;
+    sim.get_matrix(decoded);
+    for (size_t y = 0; y < CMMKProM::key_map_rows; y++) {
+        for (size_t x = 0; x < CMMKProM::key_map_cols; x++) {
+            if (CMMKProM::key_map[y][x] >= 0 && std::memcmp(&decoded[y][x], &matrix[y][x], sizeof(RGB)) != 0)
+                return false;
+        }
+    }
+    return true;
+}
+
+static void upload(CMMKProM &kb, const CMMKProM::led_matrix matrix, bool async) {
+    kb.set_leds(matrix);
+    if (async)
+        kb.wait_frame();
+}
+
+static void check_frames(bool async) {
+    const std::string mode = async ? "async: " : "sync: ";
+    std::mt19937 rng(42);
+
+    auto transport = std::make_unique<SimTransport>();
+    SimTransport &sim = *transport;
+    CMMKProM kb(std::move(transport));
+    kb.set_full_refresh_interval(0);
+    if (async)
+        kb.start_async();
+    check(sim.led_control_enabled(), mode + "LED control enabled");
+
+    CMMKProM::led_matrix matrix;
+    random_matrix(rng, matrix);
+    upload(kb, matrix, async);
+    check(board_shows(sim, matrix), mode + "first frame decoded");
+    check(sim.counters().led_packets == CMMKProM::num_packets, mode + "first frame sends every packet");
+
+    // an unchanged frame sends nothing, a single changed key sends only its packet
+    upload(kb, matrix, async);
+    check(sim.counters().led_packets == CMMKProM::num_packets, mode + "unchanged frame sends nothing");
+    kb.refresh_next_frame();
+    upload(kb, matrix, async);
+    check(sim.counters().led_packets == 2 * CMMKProM::num_packets, mode + "refreshed frame sends every packet");
+    upload(kb, matrix, async);
+    check(sim.counters().led_packets == 2 * CMMKProM::num_packets, mode + "refresh only applies to one frame");
+    matrix[2][3] = {1, 2, 3};
+    upload(kb, matrix, async);
+    check(board_shows(sim, matrix), mode + "delta frame decoded");
+    check(sim.counters().led_packets == 2 * CMMKProM::num_packets + 1, mode + "delta frame sends one packet");
+
+    for (int i = 0; i < 20; i++) {
+        random_matrix(rng, matrix);
+        upload(kb, matrix, async);
+    }
+    check(board_shows(sim, matrix), mode + "random frames decoded");
+
+    if (async)
+        kb.stop_async();
+}
+
+// Dropped reports are acknowledged, so only the periodic full refresh repairs the board
+static void check_recovery(bool async) {
+    const std::string mode = async ? "async: " : "sync: ";
+    std::mt19937 rng(7);
+
+    SimTransport::Options options;
+    options.drop_rate = 0.3;
+    options.seed = 3;
+    auto transport = std::make_unique<SimTransport>(options);
+    SimTransport &sim = *transport;
+    CMMKProM kb(std::move(transport));
+    kb.set_full_refresh_interval(4);
+    if (async)
+        kb.start_async();
+
+    CMMKProM::led_matrix matrix;
+    random_matrix(rng, matrix);
+    upload(kb, matrix, async);
+    const bool damaged = !board_shows(sim, matrix);
+
+    bool recovered = false;
+    for (int frame = 0; frame < 200 && !recovered; frame++) {
+        upload(kb, matrix, async);
+        recovered = board_shows(sim, matrix);
+    }
+    check(sim.counters().dropped > 0, mode + "packets were dropped");
+    check(damaged, mode + "drops left the board out of date");
+    check(recovered, mode + "full refresh restored the board");
+
+    if (async)
+        kb.stop_async();
+}
+
+int main() {
+    for (bool async : {false, true}) {
+        check_frames(async);
+        check_recovery(async);
+    }
+
+    if (failures == 0)
+        std::printf("sim_check: ok\n");
+    return failures == 0 ? 0 : 1;
+}
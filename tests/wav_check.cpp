@@ -0,0 +1,85 @@
+// Reads WAV headers through PcmSource, and checks that oversized or truncated chunks
+// are rejected with a runtime_error instead of being allocated or read past.
+// Run by `make check`, exits non-zero on failure.
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../audio_source.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        std::printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void put_chunk(std::vector<uint8_t> &wav, const char *id, uint32_t size) {
+    wav.insert(wav.end(), id, id + 4);
+    for (int i = 0; i < 4; i++)
+        wav.push_back((uint8_t)(size >> (8 * i)));
+}
+
+// 16 bit stereo at 44100 Hz
+static void put_fmt(std::vector<uint8_t> &wav) {
+    put_chunk(wav, "fmt ", 16);
+    const uint8_t fmt[16] = {1, 0, 2, 0, 0x44, 0xac, 0, 0, 0x10, 0xb1, 2, 0, 4, 0, 16, 0};
+    wav.insert(wav.end(), fmt, fmt + sizeof(fmt));
+}
+
+static std::vector<uint8_t> riff() {
+    std::vector<uint8_t> wav;
+    put_chunk(wav, "RIFF", 0);
+    wav.insert(wav.end(), {'W', 'A', 'V', 'E'});
+    return wav;
+}
+
+static std::string open_error(const std::string &path, const std::vector<uint8_t> &wav) {
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char *>(wav.data()), wav.size());
+    try {
+        PcmSource::open(path, PcmSource::Format{});
+    } catch (std::runtime_error &e) {
+        return e.what();
+    }
+    return "";
+}
+
+int main() {
+    const std::string path = "tests/wav_check.wav";
+
+    std::vector<uint8_t> wav = riff();
+    put_fmt(wav);
+    put_chunk(wav, "LIST", 3);
+    wav.insert(wav.end(), {1, 2, 3, 0});
+    put_chunk(wav, "data", 8);
+    wav.insert(wav.end(), {0, 0x40, 0, 0x40, 0, 0xc0, 0, 0xc0});
+    {
+        std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char *>(wav.data()), wav.size());
+        auto source = PcmSource::open(path, PcmSource::Format{});
+        float samples[4];
+        check(source->sample_rate() == 44100, "fmt read past an odd sized chunk");
+        check(source->read(samples, 4) == 2 && samples[0] == 0.5f && samples[1] == -0.5f, "samples after the skipped chunk");
+    }
+
+    // a 4 GB chunk must be skipped, not allocated
+    wav = riff();
+    put_fmt(wav);
+    put_chunk(wav, "JUNK", 0xfffffff0);
+    wav.insert(wav.end(), 100, 0);
+    check(open_error(path, wav).find("truncated") != std::string::npos, "oversized chunk is truncated, not allocated");
+
+    wav = riff();
+    put_chunk(wav, "fmt ", 0xfffffff0);
+    wav.insert(wav.end(), 100, 0);
+    check(open_error(path, wav).find("invalid WAV fmt") != std::string::npos, "oversized fmt chunk is rejected");
+    std::remove(path.c_str());
+
+    if (failures == 0)
+        std::printf("wav_check: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+
+// Moves fixed size reports between the host and a keyboard. The board answers
+// every OUT report with an IN report, one such pair is an exchange.
+class Transport {
+  public:
+    struct Exchange {
+        const uint8_t *out = nullptr;
+        uint8_t *in = nullptr;
+    };
+    // Receives 0 or the libusb error code of the first exchange that failed
+    using Completion = std::function<void(int error)>;
+
+    virtual ~Transport() = default;
+
+    // Blocking exchange of one report, throws std::runtime_error on failure
+    virtual void send_command(const uint8_t *data, uint8_t *recv_data, size_t size) = 0;
+
+    // Prepares for submit() with up to max_exchanges reports of `size` bytes per batch.
+    // on_done is called once per batch when every exchange in it has finished, possibly
+    // on another thread and possibly before submit() returns.
+    virtual void start_async(size_t max_exchanges, size_t size, Completion on_done) {
+        (void)max_exchanges;
+        async_size = size;
+        async_done = std::move(on_done);
+    }
+
+    // Starts a batch of exchanges without waiting for them, the buffers must stay
+    // valid until the completion for this batch has been called. Only one batch may
+    // be in flight at a time.
+    // The default implementation performs the exchanges synchronously.
+    virtual void submit(const Exchange *exchanges, size_t count) {
+        int error = 0;
+        for (size_t i = 0; i < count && error == 0; i++) {
+            try {
+                send_command(exchanges[i].out, exchanges[i].in, async_size);
+            } catch (std::runtime_error &) {
+                error = error_io;
+            }
+        }
+        async_done(error);
+    }
+
+    // Waits for (or cancels) the batch in flight, no completion is called afterwards
+    virtual void stop_async() {
+        async_done = nullptr;
+    }
+
+  protected:
+    // same value as LIBUSB_ERROR_IO
+    static const int error_io = -1;
+
+    size_t async_size = 0;
+    Completion async_done;
+};
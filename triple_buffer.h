@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// Lock-free single producer / single consumer triple buffer.
+// The producer fills write_buffer() and publishes it, the consumer picks up the
+// most recently published buffer; older unconsumed values are simply overwritten
+// and neither side ever waits for the other.
+// The consumer may instead sleep in wait_consume() until a value is published, the
+// producer then pays for a futex wake only while the consumer is actually asleep.
+template<typename T>
+class TripleBuffer {
+  public:
+    T &write_buffer() {
+        return buffers[write_index];
+    }
+
+    void publish() {
+        const uint8_t prev = state.exchange(write_index | dirty_bit, std::memory_order_acq_rel);
+        write_index = prev & index_mask;
+        wake_consumer();
+    }
+
+    // Swaps in the latest published buffer, returns false if nothing new was published
+    bool consume() {
+        if (!(state.load(std::memory_order_relaxed) & dirty_bit))
+            return false;
+        const uint8_t prev = state.exchange(read_index, std::memory_order_acq_rel);
+        read_index = prev & index_mask;
+        return true;
+    }
+
+    // consume(), sleeping up to timeout for a value if none is waiting
+    bool wait_consume(std::chrono::milliseconds timeout) {
+        const uint32_t wake_count = wake.load(std::memory_order_seq_cst);
+        if (consume())
+            return true;
+
+        sleeping.store(1, std::memory_order_seq_cst);
+        if (wake.load(std::memory_order_seq_cst) == wake_count) {
+            const auto s = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+            timespec ts{(time_t)s.count(), (long)std::chrono::nanoseconds(timeout - s).count()};
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&wake), FUTEX_WAIT_PRIVATE, wake_count, &ts, nullptr, 0);
+        }
+        sleeping.store(0, std::memory_order_relaxed);
+        return consume();
+    }
+
+    // Wakes a consumer in wait_consume() without publishing, eg to let it see a stop flag
+    void wake_consumer() {
+        wake.fetch_add(1, std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_seq_cst))
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&wake), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+    }
+
+    const T &read_buffer() const {
+        return buffers[read_index];
+    }
+
+  private:
+    static const uint8_t index_mask = 3;
+    static const uint8_t dirty_bit = 4;
+
+    T buffers[3]{};
+    // each side's index lives on its own cache line
+    alignas(64) uint8_t write_index = 0;
+    alignas(64) uint8_t read_index = 1;
+    // index of the spare buffer, plus dirty_bit if it holds an unconsumed value
+    alignas(64) std::atomic<uint8_t> state{2};
+    // bumped on every publish, wait_consume futex waits on it
+    alignas(64) std::atomic<uint32_t> wake{0};
+    std::atomic<uint32_t> sleeping{0};
+};
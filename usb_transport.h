@@ -0,0 +1,323 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+#include <libusb-1.0/libusb.h>
+
+#include "profiler.h"
+#include "transport.h"
+
+// Transport over a pair of libusb interrupt endpoints.
+// Async batches are queued as preallocated transfers serviced by an event thread.
+// Every transport has its own libusb context, so boards never share an event thread.
+class UsbTransport : public Transport {
+  public:
+    struct DeviceInfo {
+        // bus and port numbers from the root hub down, eg "1-2.3" as in sysfs
+        std::string port_path;
+        // empty if the device has none or could not be opened to read it
+        std::string serial;
+    };
+
+    // Lists the attached devices with the given ids
+    static std::vector<DeviceInfo> enumerate(uint16_t vid, uint16_t pid) {
+        libusb_context *ctx = nullptr;
+        throw_if_err(
+            libusb_init(&ctx),
+            "Failed to init libusb"
+        );
+
+        std::vector<DeviceInfo> found;
+        libusb_device **list;
+        const ssize_t count = libusb_get_device_list(ctx, &list);
+        for (ssize_t i = 0; i < count; i++) {
+            DeviceInfo info;
+            if (device_info(list[i], vid, pid, info))
+                found.push_back(info);
+        }
+        if (count >= 0)
+            libusb_free_device_list(list, 1);
+        libusb_exit(ctx);
+        return found;
+    }
+
+    // Opens the first device with the given ids whose port path or serial matches
+    // selector, or simply the first one if selector is empty
+    UsbTransport(
+        uint16_t vid,
+        uint16_t pid,
+        int interface,
+        unsigned char endpoint_out,
+        unsigned char endpoint_in,
+        unsigned int timeout_ms = 100,
+        const std::string &selector = ""
+    ) : interface(interface), endpoint_out(endpoint_out), endpoint_in(endpoint_in), timeout_ms(timeout_ms) {
+        throw_if_err(
+            libusb_init(&ctx),
+            "Failed to init libusb"
+        );
+
+        try {
+            dev = open_device(vid, pid, selector);
+            if (!dev)
+                throw std::runtime_error(selector.empty() ? "Failed to open device" : "Failed to open device " + selector);
+
+            if (libusb_kernel_driver_active(dev, interface)) {
+                throw_if_err(
+                    libusb_detach_kernel_driver(dev,  interface),
+                    "Failed to detach kernel driver"
+                );
+            }
+
+            throw_if_err(
+                libusb_claim_interface(dev, interface),
+                "Failed to claim interface"
+            );
+        } catch (...) {
+            if (dev)
+                libusb_close(dev);
+            libusb_exit(ctx);
+            throw;
+        }
+    }
+
+    ~UsbTransport() {
+        stop_async();
+        libusb_release_interface(dev, interface);
+        libusb_attach_kernel_driver(dev, interface);
+        libusb_close(dev);
+        libusb_exit(ctx);
+    }
+
+    // Port path of the opened device
+    const std::string &port_path() const {
+        return info.port_path;
+    }
+
+    void send_command(const uint8_t *data, uint8_t *recv_data, size_t size) override {
+        int actual;
+
+        throw_if_err(
+            libusb_interrupt_transfer(
+                dev,
+                endpoint_out,
+                const_cast<uint8_t *>(data),
+                size,
+                &actual,
+                timeout_ms
+            ),
+            "Failed to send data"
+        );
+
+        throw_if_err(
+            libusb_interrupt_transfer(
+                dev,
+                endpoint_in,
+                recv_data,
+                size,
+                &actual,
+                timeout_ms
+            ),
+            "Failed to receive data"
+        );
+    }
+
+    void start_async(size_t max_exchanges, size_t size, Completion on_done) override {
+        if (events_running)
+            return;
+
+        out_transfers.assign(max_exchanges, nullptr);
+        in_transfers.assign(max_exchanges, nullptr);
+        for (size_t i = 0; i < max_exchanges; i++) {
+            out_transfers[i] = libusb_alloc_transfer(0);
+            in_transfers[i] = libusb_alloc_transfer(0);
+            if (!out_transfers[i] || !in_transfers[i]) {
+                free_transfers();
+                throw std::runtime_error("Failed to allocate transfers");
+            }
+        }
+
+        async_size = size;
+        async_done = std::move(on_done);
+        events_running = true;
+        event_thread = std::thread(&UsbTransport::handle_events, this);
+    }
+
+    void submit(const Exchange *exchanges, size_t count) override {
+        std::unique_lock lock(mutex);
+        batch_error = 0;
+        pending_transfers = 2 * count;
+        if (pending_transfers == 0) {
+            finish_batch(lock);
+            return;
+        }
+
+        // The board answers every OUT report with an IN report, so queue the reads first
+        for (size_t i = 0; i < count; i++) {
+            libusb_fill_interrupt_transfer(
+                in_transfers[i], dev, endpoint_in,
+                exchanges[i].in, async_size,
+                on_transfer_done, this, timeout_ms
+            );
+            libusb_fill_interrupt_transfer(
+                out_transfers[i], dev, endpoint_out,
+                const_cast<uint8_t *>(exchanges[i].out), async_size,
+                on_transfer_done, this, timeout_ms
+            );
+
+            for (libusb_transfer *transfer : {in_transfers[i], out_transfers[i]}) {
+                const int ret = libusb_submit_transfer(transfer);
+                if (ret == 0)
+                    continue;
+                if (batch_error == 0)
+                    batch_error = ret;
+                if (--pending_transfers == 0) {
+                    finish_batch(lock);
+                    return;
+                }
+            }
+        }
+    }
+
+    void stop_async() override {
+        if (!events_running)
+            return;
+
+        {
+            std::unique_lock lock(mutex);
+            auto idle = [this] { return pending_transfers == 0; };
+            if (!batch_done.wait_for(lock, std::chrono::seconds(1), idle)) {
+                for (size_t i = 0; i < out_transfers.size(); i++) {
+                    libusb_cancel_transfer(out_transfers[i]);
+                    libusb_cancel_transfer(in_transfers[i]);
+                }
+                batch_done.wait(lock, idle);
+            }
+        }
+
+        events_running = false;
+        event_thread.join();
+        free_transfers();
+        async_done = nullptr;
+    }
+
+  private:
+    libusb_context *ctx = nullptr;
+    libusb_device_handle *dev = nullptr;
+    DeviceInfo info;
+    const int interface;
+    const unsigned char endpoint_out;
+    const unsigned char endpoint_in;
+    const unsigned int timeout_ms;
+
+    std::vector<libusb_transfer *> out_transfers;
+    std::vector<libusb_transfer *> in_transfers;
+    std::thread event_thread;
+    std::atomic<bool> events_running{false};
+    std::mutex mutex;
+    std::condition_variable batch_done;
+    size_t pending_transfers = 0;
+    int batch_error = 0;
+
+    static void throw_if_err(int ret, std::string msg) {
+        if (ret == 0)
+            return;
+        msg += "; ret = " + std::to_string(ret);
+        throw std::runtime_error(msg.c_str());
+    }
+
+    // Fills in info if device has the given ids
+    static bool device_info(libusb_device *device, uint16_t vid, uint16_t pid, DeviceInfo &info) {
+        libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(device, &desc) != 0)
+            return false;
+        if (desc.idVendor != vid || desc.idProduct != pid)
+            return false;
+
+        info.port_path = std::to_string(libusb_get_bus_number(device));
+        uint8_t ports[8];
+        const int num_ports = libusb_get_port_numbers(device, ports, sizeof(ports));
+        for (int i = 0; i < num_ports; i++)
+            info.port_path += (i == 0 ? "-" : ".") + std::to_string(ports[i]);
+
+        info.serial.clear();
+        libusb_device_handle *handle;
+        if (desc.iSerialNumber != 0 && libusb_open(device, &handle) == 0) {
+            unsigned char serial[128];
+            const int len = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, serial, sizeof(serial));
+            if (len > 0)
+                info.serial.assign(reinterpret_cast<const char *>(serial), len);
+            libusb_close(handle);
+        }
+        return true;
+    }
+
+    libusb_device_handle *open_device(uint16_t vid, uint16_t pid, const std::string &selector) {
+        libusb_device **list;
+        const ssize_t count = libusb_get_device_list(ctx, &list);
+        libusb_device_handle *handle = nullptr;
+        for (ssize_t i = 0; i < count && !handle; i++) {
+            if (!device_info(list[i], vid, pid, info))
+                continue;
+            if (!selector.empty() && selector != info.port_path && selector != info.serial)
+                continue;
+            if (libusb_open(list[i], &handle) != 0)
+                handle = nullptr;
+        }
+        if (count >= 0)
+            libusb_free_device_list(list, 1);
+        return handle;
+    }
+
+    static void LIBUSB_CALL on_transfer_done(libusb_transfer *transfer) {
+        auto self = static_cast<UsbTransport *>(transfer->user_data);
+        self->transfer_done(transfer);
+    }
+
+    void transfer_done(libusb_transfer *transfer) {
+        std::unique_lock lock(mutex);
+        if (transfer->status != LIBUSB_TRANSFER_COMPLETED && batch_error == 0) {
+            batch_error = transfer->status == LIBUSB_TRANSFER_TIMED_OUT
+                ? LIBUSB_ERROR_TIMEOUT
+                : LIBUSB_ERROR_IO;
+        }
+        if (--pending_transfers > 0)
+            return;
+        finish_batch(lock);
+    }
+
+    // Called with the mutex held once the last transfer of a batch is done
+    void finish_batch(std::unique_lock<std::mutex> &lock) {
+        const int error = batch_error;
+        lock.unlock();
+        batch_done.notify_all();
+        if (async_done)
+            async_done(error);
+    }
+
+    void handle_events() {
+        Profiler::name_thread(("usb " + info.port_path).c_str());
+        while (events_running) {
+            timeval tv{0, 100000};
+            libusb_handle_events_timeout_completed(ctx, &tv, nullptr);
+        }
+    }
+
+    void free_transfers() {
+        for (size_t i = 0; i < out_transfers.size(); i++) {
+            libusb_free_transfer(out_transfers[i]);
+            libusb_free_transfer(in_transfers[i]);
+        }
+        out_transfers.clear();
+        in_transfers.clear();
+    }
+};